@@ -1,152 +1,84 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "msock.h"
-#include "network.h"
 
-inline int min(int a, int b) {
-	if (a <= b) {
-		return a;
-	}
-	return b;
-}
-
-struct client_data {
-	int fd;
-	int buf_sz;
-	int buf_len;
-	int buf_pos;
-	char buf[1024*1024];
-};
+#define ECHO_HIGH_WATERMARK (256*1024)
+#define ECHO_LOW_WATERMARK (64*1024)
 
-struct server_data {
-	int fd;
-};
+/* Client process keeps nothing but its connection. */
+int client_cb(int msg_type, void *msg_payload, int msg_payload_sz,
+	      void *process_data);
 
-int client_close(struct client_data *ud)
+int client_init(void *process_data)
 {
-	printf("fd=%i pid=#%s closed\n", ud->fd, msock_pid_tostr(msock_self()));
-	close(ud->fd);
-	free(ud);
-	return RECV_EXIT;
+	msock_conn conn = msock_conn_new((long)process_data,
+					 ECHO_HIGH_WATERMARK, ECHO_LOW_WATERMARK);
+	return msock_receive(&client_cb, conn);
 }
 
-int client_read_cb(int msg_type, void *msg_payload, int msg_payload_sz,
-		   void *process_data);
-int client_write(struct client_data *ud, int block);
-int client_write_cb(int msg_type, void *msg_payload, int msg_payload_sz,
-		    void *process_data);
-
-
-int client_read(void *process_data)
+int client_close(msock_conn conn)
 {
-	struct client_data *ud = (struct client_data*)process_data;
-	msock_send_msg_fd(MSG_FD_REGISTER_READ, ud->fd, 0);
-	return msock_receive(&client_read_cb, ud);
+	printf("fd=%i pid=#%s closed\n", msock_conn_fd(conn),
+	       msock_pid_tostr(msock_self()));
+	msock_conn_free(conn);
+	return RECV_EXIT;
 }
 
-int client_read_cb(int msg_type, void *msg_payload, int msg_payload_sz,
-		   void *process_data)
+/* Echoes what was read, unless the peer doesn't keep up. Then the read
+ * buffer fills up and reading stops until MSOCK_CONN_WRITABLE. */
+int client_echo(msock_conn conn)
 {
-	struct client_data *ud = (struct client_data*)process_data;
-	int r;
-
-	switch(msg_type) {
-	case MSG_FD_READ:
-		r = read(ud->fd, ud->buf + ud->buf_len, min(64*1024, ud->buf_sz - ud->buf_len));
-		if (r > 0) {
-			ud->buf_len += r;
-			if (ud->buf[ud->buf_len-1] == '\n' ||
-			    ud->buf_len == ud->buf_sz) {
-				return client_write(ud, 0);
-			} else {
-				break;
-			}
+	while (msock_conn_rlen(conn) &&
+	       msock_conn_wlen(conn) < ECHO_HIGH_WATERMARK) {
+		struct iovec iov[16];
+		int n = msock_conn_peek(conn, iov, 16);
+		int i, len = 0;
+		for (i=0; i < n; i++) {
+			len += iov[i].iov_len;
 		}
-		// fallthrough
-	case MSG_FD_CLOSE:
-		return client_close(ud);
-	default:
-		abort();
-	}
-	return client_read(ud);
-}
-
-int client_write(struct client_data *ud, int block)
-{
-	if (block) {
-		msock_send_msg_fd(MSG_FD_REGISTER_WRITE, ud->fd, 0);
-		return msock_receive(&client_write_cb, ud);
-	} else {
-		return client_write_cb(MSG_FD_WRITE, NULL, 0, ud);
+		if (msock_conn_writev(conn, iov, n) == -1) {
+			return -1;
+		}
+		msock_conn_consume(conn, len);
 	}
+	return 0;
 }
 
-int client_write_cb(int msg_type, void *msg_payload, int msg_payload_sz,
-		    void *process_data)
+int client_cb(int msg_type, void *msg_payload, int msg_payload_sz,
+	      void *process_data)
 {
-	struct client_data *ud = (struct client_data*)process_data;
-	int r;
+	msock_conn conn = (msock_conn)process_data;
 
 	switch(msg_type) {
+	case MSG_FD_READ:
 	case MSG_FD_WRITE:
-		r = write(ud->fd, ud->buf+ud->buf_pos, min(64*1024, ud->buf_len-ud->buf_pos));
-		if (r >= 0) {
-			ud->buf_pos += r;
-			if (ud->buf_pos >= ud->buf_len) {
-				ud->buf_pos = 0;
-				ud->buf_len = 0;
-				return client_read(ud);
-			} else {
-				break;
+	case MSG_FD_CLOSE: {
+		int events = msock_conn_handle(conn, msg_type, msg_payload);
+		if (events & (MSOCK_CONN_READABLE | MSOCK_CONN_WRITABLE)) {
+			if (client_echo(conn) == -1) {
+				return client_close(conn);
 			}
 		}
-		// fallthrough
-	case MSG_FD_CLOSE:
-		return client_close(ud);
+		if (events & MSOCK_CONN_CLOSED) {
+			return client_close(conn);
+		}
+		break; }
+	case MSG_EXIT:
+		return client_close(conn);
 	default:
 		abort();
 	}
-	return client_write(ud, 1);
+	return RECV_OK;
 }
 
-int server_read_cb(int msg_type, void *msg_payload, int msg_payload_sz,
-		   void *process_data);
-
-int server_read(void *process_data)
+void client_accept(int fd, void *accept_data)
 {
-	struct server_data *sd = (struct server_data*)process_data;
-	msock_send_msg_fd(MSG_FD_REGISTER_READ, sd->fd, 0);
-	return msock_receive(&server_read_cb, process_data);
-}
-
-int server_read_cb(int msg_type, void *msg_payload, int msg_payload_sz,
-		void *process_data)
-{
-	struct server_data *sd = (struct server_data*)process_data;
-	switch(msg_type) {
-	case MSG_EXIT:
-		close(sd->fd);
-		free(sd);
-		return RECV_EXIT;
-
-	case MSG_FD_READ: {
-		struct client_data *ud = \
-			(struct client_data*)malloc(sizeof(struct client_data));
-		ud->fd = net_accept(sd->fd, NULL, NULL);
-		ud->buf_len = 0;
-		ud->buf_pos = 0;
-		ud->buf_sz = sizeof(ud->buf);
-
-		msock_pid_t pid = msock_spawn2(&client_read, ud);
-		printf("fd=%i pid=#%s new\n", ud->fd, msock_pid_tostr(pid));
-		break;
-	};
-	default:
-		abort();
-	}
-	return server_read(sd);
+	msock_pid_t pid = msock_spawn2(&client_init, (void*)(long)fd);
+	printf("fd=%i pid=#%s new\n", fd, msock_pid_tostr(pid));
 }
 
 int handle_quit_cb(int msg_type, void *msg_payload, int msg_payload_sz,
@@ -213,20 +145,24 @@ int handle_info_cb(int msg_type, void *msg_payload, int msg_payload_sz,
 }
 
 
-int main() {
-	msock_base base = msock_base_new(MSOCK_ENGINE_MASK_SELECT
-					 | MSOCK_ENGINE_MASK_SIGNAL,
-					 0);
-
-	struct server_data *sd = \
-		(struct server_data *)malloc(sizeof(struct server_data));
+int main(int argc, char **argv) {
+	struct msock_options options = {0};
+	/* Optional arguments: number of epoll engines and user domains. */
+	if (argc > 1) {
+		options.select_engines = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		options.user_domains = atoi(argv[2]);
+	}
+	msock_base base = msock_base_new2(MSOCK_ENGINE_MASK_SELECT
+					  | MSOCK_ENGINE_MASK_SIGNAL,
+					  &options);
 
-	sd->fd = net_bind("0.0.0.0", 1234);
-	if (sd->fd < 0) {
-		printf("can't bind\n");
+	if (msock_base_listen(base, "0.0.0.0", 1234, 0,
+			      &client_accept, NULL) != 0) {
+		perror("can't bind");
 		return -1;
 	}
-	msock_base_spawn2(base, &server_read, sd);
 	msock_base_spawn2(base, &handle_quit, NULL);
 	msock_base_spawn2(base, &handle_info, NULL);
 
@@ -0,0 +1,109 @@
+/* Latency of a round trip through the select and IO engines. Run with
+ * "single" argument to compare the single loop mode with the default. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define _NANO 1000000000LL
+
+/* Timespec subtraction in nanoseconds */
+#define TIMESPEC_NSEC_SUBTRACT(a,b) \
+	(((a).tv_sec - (b).tv_sec) * _NANO + (a).tv_nsec - (b).tv_nsec)
+
+
+#include "msock.h"
+
+struct ud {
+	int fd;
+	long *counter;
+};
+
+int callback(int msg_type, void *msg_payload, int msg_payload_sz,
+	     void *process_data)
+{
+	struct ud *ud= (struct ud*)process_data;
+	char c;
+
+	switch(msg_type) {
+	case MSG_FD_READ:
+		if (read(ud->fd, &c, 1) != 1) {
+			abort();
+		}
+		/* Fails on a socket, but goes through the IO engine. */
+		msock_io_fsync(ud->fd);
+		break;
+
+	case MSG_IO_FSYNC:
+		if (*ud->counter == 0) {
+			msock_loopexit();
+			break;
+		}
+		(*ud->counter)--;
+		msock_send_msg_fd(MSG_FD_REGISTER_READ, ud->fd, 0);
+		if (write(ud->fd, "x", 1) != 1) {
+			abort();
+		}
+		break;
+
+	case MSG_EXIT:
+		close(ud->fd);
+		free(ud);
+		return RECV_EXIT;
+	default:
+		abort();
+	}
+	return RECV_OK;
+}
+
+int main(int argc, char **argv)
+{
+	long rounds = 100*1000;
+	long counter = rounds;
+
+	struct msock_options options;
+	memset(&options, 0, sizeof(options));
+	options.single_loop = argc > 1 && strcmp(argv[1], "single") == 0;
+
+	msock_base base = msock_base_new2(MSOCK_ENGINE_MASK_SELECT |
+					  MSOCK_ENGINE_MASK_IO |
+					  MSOCK_ENGINE_MASK_SIGNAL,
+					  &options);
+
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		perror("socketpair()");
+		return -1;
+	}
+
+	int i;
+	msock_pid_t pids[2];
+	for (i=0; i < 2; i++) {
+		struct ud *ud = (struct ud*)calloc(1, sizeof(struct ud));
+		ud->fd = sv[i];
+		ud->counter = &counter;
+		pids[i] = msock_base_spawn(base, &callback, ud);
+		msock_base_send_msg_fd(base, pids[i], MSG_FD_REGISTER_READ,
+				       sv[i], 0);
+	}
+	if (write(sv[0], "x", 1) != 1) {
+		abort();
+	}
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	msock_base_loop(base);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	long long td = TIMESPEC_NSEC_SUBTRACT(t1, t0);
+	printf("%s: %.3fms total, %.3fus per round trip\n",
+	       options.single_loop ? "single loop" : "multi domain",
+	       (double)td/1000000,
+	       (double)td/1000/(rounds - counter));
+
+	msock_base_free(base);
+	printf("done!\n");
+
+	return 0;
+}
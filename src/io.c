@@ -1,4 +1,4 @@
-#define _XOPEN_SOURCE 500    // for pread
+#define _GNU_SOURCE          // for pread, preadv
 #define _FILE_OFFSET_BITS 64
 
 #include "config.h"
@@ -9,8 +9,10 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 DLL_LOCAL int io_open(const char *pathname, int flags, int mode, int *errno_ptr)
@@ -31,10 +33,78 @@ DLL_LOCAL int io_fsync(int fd, int *errno_ptr)
 	return r;
 }
 
-DLL_LOCAL int io_pread(int fd, char *buf, uint64_t count, uint64_t offset,
-		       int *errno_ptr)
+DLL_LOCAL int io_fdatasync(int fd, int *errno_ptr)
 {
-	int r =pread(fd, buf, count, offset);
+	int r = fdatasync(fd);
+	if (r != 0) {
+		*errno_ptr = errno;
+	}
+	return r;
+}
+
+DLL_LOCAL int io_close(int fd, int *errno_ptr)
+{
+	int r = close(fd);
+	if (r != 0) {
+		*errno_ptr = errno;
+	}
+	return r;
+}
+
+DLL_LOCAL int io_fstat(int fd, struct stat *buf, int *errno_ptr)
+{
+	int r = fstat(fd, buf);
+	if (r != 0) {
+		*errno_ptr = errno;
+	}
+	return r;
+}
+
+DLL_LOCAL ssize_t io_pread(int fd, char *buf, uint64_t count, uint64_t offset,
+			   int *errno_ptr)
+{
+	ssize_t r = pread(fd, buf, count, offset);
+	if (r == -1) {
+		*errno_ptr = errno;
+	}
+	return r;
+}
+
+DLL_LOCAL ssize_t io_pwrite(int fd, const char *buf, uint64_t count,
+			    uint64_t offset, int *errno_ptr)
+{
+	ssize_t r = pwrite(fd, buf, count, offset);
+	if (r == -1) {
+		*errno_ptr = errno;
+	}
+	return r;
+}
+
+DLL_LOCAL ssize_t io_preadv(int fd, const struct iovec *iov, int iovcnt,
+			    uint64_t offset, int *errno_ptr)
+{
+	ssize_t r = preadv(fd, iov, iovcnt, offset);
+	if (r == -1) {
+		*errno_ptr = errno;
+	}
+	return r;
+}
+
+DLL_LOCAL ssize_t io_pwritev(int fd, const struct iovec *iov, int iovcnt,
+			     uint64_t offset, int *errno_ptr)
+{
+	ssize_t r = pwritev(fd, iov, iovcnt, offset);
+	if (r == -1) {
+		*errno_ptr = errno;
+	}
+	return r;
+}
+
+DLL_LOCAL ssize_t io_sendfile(int out_fd, int in_fd, uint64_t offset,
+			      uint64_t count, int *errno_ptr)
+{
+	off_t off = offset;
+	ssize_t r = sendfile(out_fd, in_fd, &off, count);
 	if (r == -1) {
 		*errno_ptr = errno;
 	}
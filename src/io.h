@@ -2,10 +2,24 @@
 #define _IO_H
 
 #include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 DLL_LOCAL int io_open(const char *pathname, int flags, int mode, int *errno_ptr);
 DLL_LOCAL int io_fsync(int fd, int *errno_ptr);
-DLL_LOCAL int io_pread(int fd, char *buf, uint64_t count, uint64_t offset,
-		       int *errno_ptr);
+DLL_LOCAL int io_fdatasync(int fd, int *errno_ptr);
+DLL_LOCAL int io_close(int fd, int *errno_ptr);
+DLL_LOCAL int io_fstat(int fd, struct stat *buf, int *errno_ptr);
+DLL_LOCAL ssize_t io_pread(int fd, char *buf, uint64_t count, uint64_t offset,
+			   int *errno_ptr);
+DLL_LOCAL ssize_t io_pwrite(int fd, const char *buf, uint64_t count,
+			    uint64_t offset, int *errno_ptr);
+DLL_LOCAL ssize_t io_preadv(int fd, const struct iovec *iov, int iovcnt,
+			    uint64_t offset, int *errno_ptr);
+DLL_LOCAL ssize_t io_pwritev(int fd, const struct iovec *iov, int iovcnt,
+			     uint64_t offset, int *errno_ptr);
+DLL_LOCAL ssize_t io_sendfile(int out_fd, int in_fd, uint64_t offset,
+			      uint64_t count, int *errno_ptr);
 
 #endif // _IO_H
@@ -33,13 +33,15 @@ struct mem_page {
 static void page_alloc(struct mem_zone *zone);
 static void page_free(struct mem_zone *zone, struct mem_page *page);
 
-DLL_LOCAL void init_mem_zone(struct mem_zone *zone, int chunk_size)
+DLL_LOCAL void init_mem_zone(struct mem_zone *zone, int chunk_size,
+			     int page_size)
 {
 	INIT_SPIN_LOCK(&zone->lock);
+	zone->page_size = page_size;
 	zone->chunk_size = chunk_size;
 	zone->aligned_chunk_size = cacheline_align(chunk_size);
 
-	int avail_bytes = PAGE_SIZE \
+	int avail_bytes = zone->page_size \
 		- cacheline_align(sizeof(struct mem_page));
 	zone->chunks_per_page = avail_bytes / zone->aligned_chunk_size;
 	zone->alloc_pages = 0;
@@ -119,7 +121,7 @@ DLL_LOCAL void cache_drain(struct mem_cache *cache)
 		}
 		struct mem_chunk *chunk = \
 			container_of(head, struct mem_chunk, in_queue);
-		struct mem_page *page = _page_from_chunk(chunk);
+		struct mem_page *page = _page_from_chunk(zone, chunk);
 		queue_put_head(&chunk->in_queue,
 			       &page->queue_of_free_chunks);
 		if (page->free_chunks == 0) {
@@ -140,16 +142,16 @@ DLL_LOCAL void cache_drain(struct mem_cache *cache)
 static void page_alloc(struct mem_zone *zone)
 {
 	void *ptr;
-	int r = posix_memalign(&ptr, PAGE_SIZE, PAGE_SIZE);
+	int r = posix_memalign(&ptr, zone->page_size, zone->page_size);
 	if (r != 0) {
 		/* TODO: attempt to reclaim some memory before failing? */
-		pfatal("posix_memalign(%i, %i)", PAGE_SIZE, PAGE_SIZE);
+		pfatal("posix_memalign(%i, %i)", zone->page_size, zone->page_size);
 	}
 
 	#ifdef VALGRIND
 	VALGRIND_CREATE_MEMPOOL(ptr, 0, 0);
 	VALGRIND_MAKE_MEM_NOACCESS(ptr + sizeof(struct mem_page),
-		PAGE_SIZE - sizeof(struct mem_page));
+		zone->page_size - sizeof(struct mem_page));
 	#endif
 
 	struct mem_page *page = (struct mem_page*)ptr;
@@ -184,7 +186,7 @@ static void page_free(struct mem_zone *zone, struct mem_page *page)
 	list_del(&page->in_list);
 	#ifdef VALGRIND
 	VALGRIND_DESTROY_MEMPOOL(page);
-	VALGRIND_MAKE_MEM_NOACCESS(page, PAGE_SIZE);
+	VALGRIND_MAKE_MEM_NOACCESS(page, zone->page_size);
 	#endif
 	free(page);
 	zone->freed_pages++;
@@ -196,5 +198,5 @@ DLL_LOCAL unsigned long zone_used_bytes(struct mem_zone *zone)
 	spin_lock(&zone->lock);
 	pages = zone->alloc_pages - zone->freed_pages;
 	spin_unlock(&zone->lock);
-	return pages * PAGE_SIZE;
+	return pages * zone->page_size;
 }
@@ -10,6 +10,7 @@
  *  - chunk - object/item/buffer */
 struct mem_zone {
 	spinlock_t lock;
+	int page_size;
 	int chunk_size;
 	int aligned_chunk_size;
 	int chunks_per_page;
@@ -31,12 +32,17 @@ struct mem_chunk {
 
 
 #define INIT_MEM_ZONE(zone, size)		\
-	init_mem_zone(zone, size);
+	init_mem_zone(zone, size, PAGE_SIZE);
+
+#define INIT_MEM_ZONE2(zone, size, page_size)	\
+	init_mem_zone(zone, size, page_size);
 
 #define INIT_MEM_CACHE(cache, zone)		\
 	init_mem_cache(cache, zone);
 
-DLL_LOCAL void init_mem_zone(struct mem_zone *zone, int chunk_size);
+/* 'page_size' must be a power of 2, big enough for two chunks. */
+DLL_LOCAL void init_mem_zone(struct mem_zone *zone, int chunk_size,
+			     int page_size);
 DLL_LOCAL void zone_free(struct mem_zone *zone);
 
 DLL_LOCAL void init_mem_cache(struct mem_cache *cache, struct mem_zone *zone);
@@ -55,10 +61,11 @@ DLL_LOCAL void _cache_fill(struct mem_cache *cache);
 		_cache_free(cache, a);				\
 	} while (0)
 
-static inline struct mem_page *_page_from_chunk(struct mem_chunk *chunk)
+static inline struct mem_page *_page_from_chunk(struct mem_zone *zone,
+						struct mem_chunk *chunk)
 {
 	unsigned long v_page = \
-		(unsigned long)chunk & ~((unsigned long)PAGE_SIZE-1);
+		(unsigned long)chunk & ~((unsigned long)zone->page_size-1);
 	return (struct mem_page *)v_page;
 }
 
@@ -73,7 +80,7 @@ static inline void *_cache_malloc(struct mem_cache *cache)
 		container_of(head, struct mem_chunk, in_queue);
 
 	#ifdef VALGRIND
-	void *page = _page_from_chunk(chunk);
+	void *page = _page_from_chunk(cache->zone, chunk);
 	VALGRIND_MEMPOOL_ALLOC(page, chunk, cache->zone->chunk_size);
 	#endif
 	return chunk;
@@ -84,7 +91,7 @@ static inline void _cache_free(struct mem_cache *cache, void *v_chunk)
 	struct mem_chunk *chunk = v_chunk;
 
 	#ifdef VALGRIND
-	void *page = _page_from_chunk(chunk);
+	void *page = _page_from_chunk(cache->zone, chunk);
 	VALGRIND_MEMPOOL_FREE(page, chunk);
 	VALGRIND_MAKE_MEM_DEFINED(chunk, sizeof(struct mem_chunk));
 	#endif
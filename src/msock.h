@@ -11,11 +11,53 @@ extern "C" {
 
 #include <signal.h>
 #include <stdint.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 typedef void *msock_pid_t;
 typedef void *msock_base;
 
+/* 'max_processes' is only a hint for the initial size of the process
+ * table, which grows when needed. Zero means the default. */
 DLL_PUBLIC msock_base msock_base_new(int engines, int max_processes);
+
+/* Zero means the default for every field. */
+struct msock_options {
+	int max_processes;
+	/* Number of epoll domains, each with its own thread. An fd goes to
+	 * engine fd % select_engines, whichever domain its owner is in. */
+	int select_engines;
+	/* Deliver readiness of many fds of a process in a single
+	 * MSG_FD_READY_BATCH message. */
+	int select_batch;
+	/* Spin in non-blocking epoll_wait() that long before blocking. */
+	int select_busy_poll_usecs;
+	/* Number of domains for user processes, each gets its own
+	 * listener from msock_base_listen(). They have no threads, the
+	 * select engine threads run them: accepting and IO only scale
+	 * with select_engines raised too. */
+	int user_domains;
+	/* Run everything on the calling thread, blocking only in the
+	 * select engine. Forces a single select engine and user domain.
+	 * IO requests are then done inline and block the loop. */
+	int single_loop;
+	/* Threads running blocking IO requests, 0 means default (4).
+	 * Requests for one fd are still done in order. */
+	int io_threads;
+	/* Submit IO requests through io_uring instead of the threads.
+	 * Falls back to threads if the kernel doesn't support it. */
+	int io_uring;
+	/* Pool of O_DIRECT buffers: number and size of them, 0 means
+	 * default (64 of 128KiB). Huge pages are tried if
+	 * 'io_buffers_huge' is set. */
+	int io_buffers;
+	int io_buffer_sz;
+	int io_buffers_huge;
+};
+
+DLL_PUBLIC msock_base msock_base_new2(int engines,
+				      struct msock_options *options);
 DLL_PUBLIC void msock_base_free(msock_base base);
 
 
@@ -76,6 +118,70 @@ struct msock_msg_fd {
 	unsigned long expires;
 };
 
+enum msock_fd_events {
+	MSOCK_FD_EV_READ  = 1 << 0,
+	MSOCK_FD_EV_WRITE = 1 << 1,
+	MSOCK_FD_EV_CLOSE = 1 << 2
+};
+
+struct msock_msg_fd_batch_item {
+	int fd;
+	int events;
+};
+
+/* Must fit in a message payload. */
+#define MSOCK_FD_BATCH_MAX (27)
+
+struct msock_msg_fd_batch {
+	int count;
+	struct msock_msg_fd_batch_item items[MSOCK_FD_BATCH_MAX];
+};
+
+/* Buffer of MSG_FD_RECV, filled by the select engine. Size is chosen
+ * so that four of them fit a 64KiB page of the buffer pool. */
+#define MSOCK_BUF_SZ (16384 - 64)
+
+struct msock_msg_fd_recv {
+	int fd;
+	/* Bytes in 'buf', 0 on end of stream, -1 on error. */
+	int len;
+	int saved_errno;
+	/* Only set if len > 0, must be given back with msock_buf_free(). */
+	char *buf;
+};
+
+/* Datagram in a pool buffer, must be given back with msock_buf_free().
+ * Can be rewritten and sent back with msock_udp_sendv(). */
+struct msock_dgram {
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	int len;
+	/* Was longer than MSOCK_DGRAM_MAX and got cut. */
+	int truncated;
+	char data[];
+};
+
+#define MSOCK_DGRAM_MAX ((int)(MSOCK_BUF_SZ - sizeof(struct msock_dgram)))
+/* Most datagrams read by one recvmmsg(), fits in a message payload. */
+#define MSOCK_DGRAM_BATCH (24)
+
+struct msock_msg_fd_dgrams {
+	int fd;
+	/* Zero on error. */
+	int count;
+	int saved_errno;
+	struct msock_dgram *dgrams[MSOCK_DGRAM_BATCH];
+};
+
+struct msock_msg_pipe {
+	int in_fd;
+	int out_fd;
+	/* Bytes moved from 'in_fd' to 'out_fd'. */
+	uint64_t count;
+	/* 0 on end of stream of 'in_fd', ECANCELED after msock_pipe_stop(). */
+	int saved_errno;
+};
+
 struct msock_msg_signal {
 	int signum;
 	msock_pid_t victim;
@@ -90,11 +196,48 @@ enum msock_msgs {
 	MSG_FD_TIMEOUTED,
 	MSG_FD_REGISTER_READ,
 	MSG_FD_REGISTER_WRITE,
+	/* Drops read and write registrations of the victim on the fd.
+	 * Send it before closing an fd unless the last event on it was
+	 * end of stream or an error, the number can be reused at once. */
 	MSG_FD_UNREGISTER,
-
+	/* Edge triggered read and write notifications, stay registered
+	 * until MSG_FD_UNREGISTER or timeout. Subscribing again re-arms.
+	 * Read/write until EAGAIN; notifications may be spurious. */
+	MSG_FD_SUBSCRIBE,
+	/* Sent instead of MSG_FD_READ/WRITE/CLOSE with 'select_batch'
+	 * option, if a process has more than one event ready. */
+	MSG_FD_READY_BATCH,
+	/* Like MSG_FD_REGISTER_READ, but the engine reads the data and
+	 * sends it in MSG_FD_RECV. */
+	MSG_FD_REGISTER_RECV,
+	MSG_FD_RECV,
+	/* Like MSG_FD_REGISTER_RECV for datagram sockets, up to
+	 * MSOCK_DGRAM_BATCH datagrams come in one MSG_FD_RECV_DGRAMS. */
+	MSG_FD_REGISTER_RECV_DGRAMS,
+	MSG_FD_RECV_DGRAMS,
+
+	/* Replies carry struct msock_msg_io. */
 	MSG_IO_FSYNC,
 	MSG_IO_OPEN,
 	MSG_IO_PREAD,
+	MSG_IO_PWRITE,
+	MSG_IO_PREADV,
+	MSG_IO_PWRITEV,
+	MSG_IO_FDATASYNC,
+	MSG_IO_CLOSE,
+	MSG_IO_FSTAT,
+	MSG_IO_SENDFILE,
+	MSG_IO_LOG_APPEND,
+	MSG_IO_BUF_LEASE,
+	MSG_IO_BUF_RELEASE,
+	MSG_IO_STREAM_OPEN,
+	MSG_IO_STREAM_CHUNK,
+	MSG_IO_STREAM_DONE,
+	MSG_IO_STREAM_CLOSE,
+
+	/* Reply of msock_pipe_fds(), carries struct msock_msg_pipe. */
+	MSG_PIPE_DONE,
+	MSG_PIPE_STOP,
 
 	MSG_SIGNAL_REGISTER,
 	MSG_SIGNAL_UNREGISTER,
@@ -114,6 +257,7 @@ enum msock_msgs {
 enum enigine_types {
 	MSOCK_ENGINE_MASK_SELECT  = 1 << 2,
 	MSOCK_ENGINE_MASK_IO      = 1 << 3,
+	/* Implies MSOCK_ENGINE_MASK_SELECT. */
 	MSOCK_ENGINE_MASK_SIGNAL  = 1 << 4
 };
 
@@ -124,7 +268,7 @@ enum enigine_types {
 //#define PID_TIMER     ((msock_pid_t)(2))
 #define PID_IO        ((msock_pid_t)(3))
 #define PID_SIGNAL    ((msock_pid_t)(4))
-#define MSOCK_MAX_DOMAINS   (5)
+#define MSOCK_MAX_DOMAINS   (16)
 
 
 /* Engine public interfaces: */
@@ -140,9 +284,224 @@ DLL_PUBLIC void msock_base_send_msg_fd(msock_base base,
 				       int msg_type, int fd,
 				       unsigned long timeout_msecs);
 
+/* Called in the domain of the listener for every accepted connection,
+ * 'fd' is non-blocking. Usually spawns a process to handle it. */
+typedef void (*msock_accept_t)(int fd, void *accept_data);
+
+/* Opens a SO_REUSEPORT listener in every user domain, the kernel spreads
+ * new connections between them. 'backlog' of zero means SOMAXCONN.
+ * Returns -1 and sets errno on failure. */
+DLL_PUBLIC int msock_base_listen(msock_base base,
+				 const char *host, int port, int backlog,
+				 msock_accept_t accept_cb, void *accept_data);
+
+/* Gives MSG_FD_RECV buffer or a datagram back to the pool. */
+DLL_PUBLIC void msock_buf_free(char *buf);
+
+/* Buffered connection on a non-blocking socket, used by one process.
+ * Buffers are chains of pool segments, an idle connection holds none.
+ * Reading stops when the read buffer reaches 'high_watermark' and goes
+ * on when it's consumed below 'low_watermark', or when a
+ * msock_conn_frame_*() call needs more than is buffered. Zero
+ * watermarks mean the defaults (256KiB and 64KiB). */
+typedef void *msock_conn;
+
+enum msock_conn_events {
+	MSOCK_CONN_READABLE = 1 << 0,
+	/* Write buffer fell to the low watermark. */
+	MSOCK_CONN_WRITABLE = 1 << 1,
+	/* End of stream or error, msock_conn_free() is up to the user. */
+	MSOCK_CONN_CLOSED   = 1 << 2
+};
+
+/* Subscribes the current process to 'fd'. */
+DLL_PUBLIC msock_conn msock_conn_new(int fd, int high_watermark,
+				     int low_watermark);
+/* Closes the fd, what the socket doesn't take at once is dropped. */
+DLL_PUBLIC void msock_conn_free(msock_conn conn);
+DLL_PUBLIC int msock_conn_fd(msock_conn conn);
+/* Takes MSG_FD_READ, MSG_FD_WRITE, MSG_FD_CLOSE and MSG_FD_READY_BATCH
+ * for the fd, reads and writes what it can. Returns msock_conn_events. */
+DLL_PUBLIC int msock_conn_handle(msock_conn conn, int msg_type,
+				 void *msg_payload);
+
+/* Bytes in the read buffer. */
+DLL_PUBLIC int msock_conn_rlen(msock_conn conn);
+/* Points 'iov' at the read buffer without copying, returns the number
+ * of iovecs used. */
+DLL_PUBLIC int msock_conn_peek(msock_conn conn, struct iovec *iov, int iovcnt);
+DLL_PUBLIC void msock_conn_consume(msock_conn conn, int len);
+/* Copies and consumes up to 'len' bytes, returns how many. */
+DLL_PUBLIC int msock_conn_read(msock_conn conn, char *buf, int len);
+
+/* Frames of the read buffer, without copying: 'iov' is pointed at the
+ * payload, '*iovcnt' is the room in it on entry and what's used on
+ * return. Return value is what to msock_conn_consume() once done with
+ * the frame, 0 if there's no whole frame yet, or -1 and errno:
+ * EMSGSIZE if the frame can't fit under the high watermark, ENOBUFS if
+ * 'iov' is too short. Frames are taken one by one, so pipelined
+ * requests come out of a single read. */
+
+/* Frame ends with 'delim', which isn't part of the payload. Bytes once
+ * scanned aren't looked at again. */
+DLL_PUBLIC int msock_conn_frame_delim(msock_conn conn, char delim,
+				      struct iovec *iov, int *iovcnt);
+/* Frame starts with its payload length, big endian, 'prefix_sz' of 1
+ * to 4 bytes. Other sizes fail with EINVAL. */
+DLL_PUBLIC int msock_conn_frame_prefix(msock_conn conn, int prefix_sz,
+				       struct iovec *iov, int *iovcnt);
+
+/* Buffers the data. All writes to a connection during a run of the
+ * domain are sent together, with one sendmsg(), when the run ends.
+ * Returns 0, 1 if the write buffer is over the high watermark - wait
+ * for MSOCK_CONN_WRITABLE then - or -1 and sets errno if the connection
+ * broke. */
+DLL_PUBLIC int msock_conn_write(msock_conn conn, const char *buf, int len);
+DLL_PUBLIC int msock_conn_writev(msock_conn conn, const struct iovec *iov,
+				 int iovcnt);
+/* Sends now instead of at the end of the run. Returns -1 and sets
+ * errno if the connection broke. */
+DLL_PUBLIC int msock_conn_flush(msock_conn conn);
+/* Bytes waiting in the write buffer. */
+DLL_PUBLIC int msock_conn_wlen(msock_conn conn);
+
+/* Non-blocking UDP socket bound to 'host' and 'port'. Returns -1 and
+ * sets errno on failure. */
+DLL_PUBLIC int msock_udp_bind(const char *host, int port);
+/* Sends datagrams with as few sendmmsg() as possible, each to its 'addr'
+ * (or the connected peer if 'addr_len' is 0). Returns how many went out,
+ * less if the socket buffer filled up, or -1 and sets errno. */
+DLL_PUBLIC int msock_udp_sendv(int fd, struct msock_dgram **dgrams, int count);
+
+/* Moves everything from 'in_fd' to 'out_fd' inside the kernel, with
+ * splice() through a pooled pipe, the data never comes to user space.
+ * Both fds must be non-blocking sockets or pipes. A helper process in
+ * the current domain waits for them to be ready, so no one else may
+ * wait for 'in_fd' to read or 'out_fd' to write; two calls proxy both
+ * ways. Replies once, with MSG_PIPE_DONE. The fds stay open, close
+ * them after the reply. Returns the helper, or NULL and sets errno if
+ * no pipe could be made. */
+DLL_PUBLIC msock_pid_t msock_pipe_fds(int in_fd, int out_fd);
+/* Makes a running helper reply at once. */
+DLL_PUBLIC void msock_pipe_stop(msock_pid_t pipe);
+
+typedef void *msock_log;
+typedef void *msock_stream;
+
+struct msock_msg_io {
+	msock_pid_t victim;
+	/* All but open. Output fd of sendfile. */
+	int fd;
+
+	/* pread, pwrite */
+	char *buf;
+	/* Reads, writes and sendfile: bytes done on return,
+	 * (uint64_t)-1 on error. */
+	uint64_t count;
+	uint64_t offset;
+
+	/* preadv, pwritev */
+	const struct iovec *iov;
+	int iovcnt;
+
+	/* open */
+	char *pathname;
+	int flags;
+	int mode;
+
+	/* fstat */
+	struct stat *stat;
+
+	/* sendfile */
+	int in_fd;
+
+	/* log append, 'offset' is where the record was written */
+	msock_log log;
+
+	/* stream chunk */
+	msock_stream stream;
+
+	/* From msock_io_set_class() */
+	int io_class;
+	unsigned long expires;
+
+	/* Result of fsync, fdatasync, close and fstat. Open returns
+	 * the new fd in 'fd'. */
+	int ret;
+	int saved_errno;
+};
+
+/* All of these reply with a message of the same type. Buffers must
+ * stay valid until then. Requests for one fd are done in order. */
 DLL_PUBLIC void msock_io_fsync(int fd);
+DLL_PUBLIC void msock_io_fdatasync(int fd);
 DLL_PUBLIC void msock_io_open(char *pathname, int flags, int mode);
+DLL_PUBLIC void msock_io_close(int fd);
+DLL_PUBLIC void msock_io_fstat(int fd, struct stat *buf);
 DLL_PUBLIC void msock_io_pread(int fd, char *buf, uint64_t count, uint64_t offset);
+DLL_PUBLIC void msock_io_pwrite(int fd, const char *buf, uint64_t count,
+				uint64_t offset);
+DLL_PUBLIC void msock_io_preadv(int fd, const struct iovec *iov, int iovcnt,
+				uint64_t offset);
+DLL_PUBLIC void msock_io_pwritev(int fd, const struct iovec *iov, int iovcnt,
+				 uint64_t offset);
+/* Copies from 'in_fd' at 'offset' to the current position of 'out_fd'. */
+DLL_PUBLIC void msock_io_sendfile(int out_fd, int in_fd, uint64_t offset,
+				  uint64_t count);
+
+enum msock_io_class {
+	MSOCK_IO_NORMAL = 0,
+	/* Run before anything else, ie: reads for a waiting user. */
+	MSOCK_IO_INTERACTIVE,
+	/* Run when nothing else waits, ie: compaction. */
+	MSOCK_IO_BACKGROUND
+};
+
+/* Class of further IO requests of the current process. Requests not
+ * started within 'timeout_msecs' (0 is never) are answered with
+ * ETIMEDOUT instead of being run. Within a class requests closest to
+ * their deadline go first. Requests for one fd still run in order. */
+DLL_PUBLIC void msock_io_set_class(int io_class, unsigned long timeout_msecs);
+
+/* Leases a buffer for O_DIRECT, aligned to 4KiB. Replies with
+ * MSG_IO_BUF_LEASE, the buffer in 'buf' and its size in 'count'. If all
+ * are leased the reply waits for a release. */
+DLL_PUBLIC void msock_io_buf_lease();
+DLL_PUBLIC void msock_io_buf_release(char *buf);
+
+/* Reads 'fd' from the start in 'chunk_sz' pieces, keeping up to 'depth'
+ * reads in flight. Chunks come in order as MSG_IO_STREAM_CHUNK with
+ * data in 'buf', its length in 'count' and the position in 'offset'.
+ * The last one has 'count' 0 (end of file) or (uint64_t)-1 (error)
+ * and no 'buf'. Every 'buf' must be given back with
+ * msock_io_stream_done(), that's what lets the next read go, and not
+ * touched after. A NULL 'buf' is ignored. */
+DLL_PUBLIC msock_stream msock_io_stream_open(int fd, int chunk_sz, int depth);
+DLL_PUBLIC void msock_io_stream_done(msock_stream stream, char *buf);
+/* No reads are started after this. Chunks already sent may still
+ * come, the last one too: give back their 'buf' with
+ * msock_io_stream_done() as before. That's all a closed stream may be
+ * used for, the engine frees it and its buffers once every 'buf' is
+ * back. Doesn't close 'fd'. */
+DLL_PUBLIC void msock_io_stream_close(msock_stream stream);
+
+/* Append only log with group commit: appends from all processes that
+ * wait together are written with one pwritev() and one fdatasync().
+ * Open before and close after the loop. Returns NULL and sets errno. */
+DLL_PUBLIC msock_log msock_log_open(const char *pathname);
+DLL_PUBLIC void msock_log_close(msock_log log);
+/* Replies with MSG_IO_LOG_APPEND once the record is on disk. */
+DLL_PUBLIC void msock_log_append(msock_log log, const char *buf, uint64_t len);
+
+struct msock_io_stats {
+	unsigned long queued;		/* Waiting or being run now */
+	unsigned long completed;
+	unsigned long service_usecs;	/* Total time spent running */
+	unsigned long coalesced;	/* Answered by another sync */
+	unsigned long expired;		/* Answered with ETIMEDOUT */
+};
+/* Counters for one kind of IO request, ie: MSG_IO_PREAD. */
+DLL_PUBLIC void msock_io_stats(int msg_type, struct msock_io_stats *stats);
 
 DLL_PUBLIC char* msock_pid_tostr(msock_pid_t pid);
 
@@ -156,6 +515,9 @@ DLL_PUBLIC void msock_send_msg_signal(int msg_type,
 DLL_PUBLIC void msock_memory_collect();
 DLL_PUBLIC void msock_memory_stats(unsigned long *used_bytes_ptr);
 
+/* Time spent by all epoll engines in busy polling. */
+DLL_PUBLIC void msock_select_stats(unsigned long *busy_poll_usecs_ptr);
+
 
 #ifdef __cplusplus
 }
@@ -2,19 +2,46 @@
 
 #include "msock_internal.h"
 
+/* Pages of the receive buffers pool. */
+#define BUFFER_PAGE_SIZE (65536)
+/* Freed buffers kept in a domain before they go back to the zone. */
+#define BUFFERS_KEPT (16)
+
 DLL_PUBLIC msock_base msock_base_new(int engines, int max_processes)
+{
+	struct msock_options options;
+	memset(&options, 0, sizeof(options));
+	options.max_processes = max_processes;
+	return msock_base_new2(engines, &options);
+}
+
+DLL_PUBLIC msock_base msock_base_new2(int engines,
+				      struct msock_options *options)
 {
 	struct base *base = type_malloc(struct base);
+	if (options) {
+		base->options = *options;
+	}
+	if (base->options.single_loop) {
+		base->options.select_engines = 1;
+		base->options.user_domains = 1;
+	}
 
 	INIT_MSQUEUE_ROOT(&base->queue_of_domains);
 	INIT_SPIN_LOCK(&base->lock);
 	INIT_MEM_ZONE(&base->zone_messages, sizeof(struct message));
 	INIT_MEM_ZONE(&base->zone_processes, sizeof(struct process));
+	INIT_MEM_ZONE2(&base->zone_buffers, MSOCK_BUF_SZ, BUFFER_PAGE_SIZE);
 
 	INIT_LIST_HEAD(&base->list_of_domains);
 	INIT_LIST_HEAD(&base->list_of_workers);
 
-	engines_start(base, engines | MSOCK_ENGINE_MASK_USER, max_processes);
+	/* Signals are read from a signalfd by the select engine. */
+	if (engines & MSOCK_ENGINE_MASK_SIGNAL) {
+		engines |= MSOCK_ENGINE_MASK_SELECT;
+	}
+	engines_start(base, engines | MSOCK_ENGINE_MASK_USER,
+		      base->options.max_processes);
 
 	return (msock_base)base;
 }
@@ -28,6 +55,7 @@ DLL_PUBLIC void msock_base_free(msock_base mbase)
 
 	zone_free(&base->zone_messages);
 	zone_free(&base->zone_processes);
+	zone_free(&base->zone_buffers);
 
 	type_free(struct base, base);
 }
@@ -115,6 +143,46 @@ DLL_LOCAL void send_indirect(struct domain *domain,
 	_send_indirect(domain, target, msg_type, msg_payload, msg_payload_sz);
 }
 
+DLL_LOCAL char *buffer_alloc(struct domain *domain)
+{
+	return cache_malloc(&domain->cache_buffers, char);
+}
+
+DLL_LOCAL void buffer_free(struct domain *domain, char *buf)
+{
+	cache_free(&domain->cache_buffers, char, buf);
+	if (unlikely(++domain->buffers_freed == BUFFERS_KEPT)) {
+		cache_drain(&domain->cache_buffers);
+		domain->buffers_freed = 0;
+	}
+}
+
+DLL_PUBLIC void msock_buf_free(char *buf)
+{
+	buffer_free(get_current_process()->domain, buf);
+}
+
+/* Message that will never be received, payload can own a buffer. */
+DLL_LOCAL void message_drop(struct domain *domain, struct message *msg)
+{
+	if (unlikely(msg->msg_type == MSG_FD_RECV)) {
+		struct msock_msg_fd_recv *rmsg = \
+			(struct msock_msg_fd_recv *)msg->msg_payload;
+		if (rmsg->buf) {
+			buffer_free(domain, rmsg->buf);
+		}
+	}
+	if (unlikely(msg->msg_type == MSG_FD_RECV_DGRAMS)) {
+		struct msock_msg_fd_dgrams *dmsg = \
+			(struct msock_msg_fd_dgrams *)msg->msg_payload;
+		int i;
+		for (i=0; i < dmsg->count; i++) {
+			buffer_free(domain, (char*)dmsg->dgrams[i]);
+		}
+	}
+	cache_free(&domain->cache_messages, struct message, msg);
+}
+
 DLL_LOCAL void drain_message_queue(struct domain *domain, struct queue_root *msgbox)
 {
 	while (1) {
@@ -123,7 +191,7 @@ DLL_LOCAL void drain_message_queue(struct domain *domain, struct queue_root *msg
 			break;
 		}
 		struct message *msg = container_of(head, struct message, in_queue);
-		cache_free(&domain->cache_messages, struct message, msg);
+		message_drop(domain, msg);
 	}
 }
 
@@ -225,6 +293,9 @@ DLL_PUBLIC void msock_base_loop(msock_base mbase)
 {
 	struct base *base = (struct base *)mbase;
 	int workers_no = max(0, count_hungry_domains(base)-1);
+	if (base->options.single_loop) {
+		workers_no = 0;
+	}
 
 	workers_create(base, workers_no);
 	worker_loop(base);
@@ -277,8 +348,18 @@ DLL_PUBLIC void msock_memory_stats(unsigned long *used_bytes_ptr)
 
 	unsigned long used_bytes =			\
 		zone_used_bytes(&base->zone_messages) +	\
-		zone_used_bytes(&base->zone_processes);
+		zone_used_bytes(&base->zone_processes) + \
+		zone_used_bytes(&base->zone_buffers);
 	if (used_bytes_ptr) {
 		*used_bytes_ptr = used_bytes;
 	}
 }
+
+DLL_PUBLIC void msock_select_stats(unsigned long *busy_poll_usecs_ptr)
+{
+	struct base *base = get_current_process()->domain->base;
+
+	if (busy_poll_usecs_ptr) {
+		*busy_poll_usecs_ptr = base->select_busy_poll_usecs;
+	}
+}
@@ -3,12 +3,16 @@
 
 struct domain;
 
+/* Number of MSG_IO_* message types. */
+#define IO_OPS (MSG_IO_STREAM_CLOSE - MSG_IO_FSYNC + 1)
+
 struct base {
 	struct msqueue_root queue_of_domains;
 
 	// Locking is done inside mem_zones.
 	struct mem_zone zone_messages;
 	struct mem_zone zone_processes;
+	struct mem_zone zone_buffers;
 
 	spinlock_t lock;
 	struct domain *gid_to_domain[MAX_DOMAINS];
@@ -16,6 +20,17 @@ struct base {
 	struct list_head list_of_workers;
 
 	msock_pid_t name_to_pid[MAX_REG_NAMES];
+
+	struct msock_options options;
+	/* First one is the default for msock_base_spawn(). */
+	int user_domains;
+	struct domain *user_domain[MAX_DOMAINS];
+	/* Epoll domains, fd goes to select_pids[fd % select_engines]. */
+	int select_engines;
+	msock_pid_t select_pids[MAX_DOMAINS];
+	unsigned long select_busy_poll_usecs;
+	/* Updated by the IO engine, indexed by msg_type - MSG_IO_FSYNC. */
+	struct msock_io_stats io_stats[IO_OPS];
 };
 
 
@@ -29,6 +44,9 @@ DLL_LOCAL void send_indirect(struct domain *domain,
 			     int msg_type,
 			     void* msg_payload, int msg_payload_sz);
 DLL_LOCAL int send_flush_outbox(struct domain *domain);
+DLL_LOCAL char *buffer_alloc(struct domain *domain);
+DLL_LOCAL void buffer_free(struct domain *domain, char *buf);
+DLL_LOCAL void message_drop(struct domain *domain, struct message *msg);
 DLL_LOCAL void drain_message_queue(struct domain *domain,
 				   struct queue_root *msgbox);
 
@@ -0,0 +1,534 @@
+/* Buffered connections: data waits in chains of segments taken from the
+ * domain's receive buffer pool, an idle connection holds none. */
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "msock_internal.h"
+#include "scan.h"
+
+
+/* Segment lives at the start of a pool buffer. */
+struct conn_seg {
+	struct list_head in_buf;
+	int start;
+	int end;
+	char data[];
+};
+
+#define SEG_DATA_SZ ((int)(MSOCK_BUF_SZ - sizeof(struct conn_seg)))
+
+/* Segments gathered by a single readv() or sendmsg(). */
+#define CONN_IOV (64)
+
+#define CONN_HIGH_WATERMARK (256*1024)
+#define CONN_LOW_WATERMARK (64*1024)
+
+struct conn_buf {
+	struct list_head segs;
+	int len;
+};
+
+struct conn {
+	struct list_head in_corked;	/* in domain->list_of_corked_conns */
+	int fd;
+	int high_watermark;
+	int low_watermark;
+	struct domain *domain;
+	struct conn_buf rbuf;
+	struct conn_buf wbuf;
+	/* Read buffer went over the high watermark before EAGAIN. */
+	int read_paused;
+	/* Write buffer went over the high watermark, the user waits for
+	 * MSOCK_CONN_WRITABLE. */
+	int write_blocked;
+	/* End of stream or error seen. */
+	int closed;
+	/* Read buffer bytes known not to have the delimiter. */
+	int scanned;
+};
+
+
+static struct conn_seg *seg_new(struct conn *c)
+{
+	struct conn_seg *seg = (struct conn_seg *)buffer_alloc(c->domain);
+	seg->start = 0;
+	seg->end = 0;
+	return seg;
+}
+
+static void buf_drop(struct conn *c, struct conn_buf *b, int len)
+{
+	b->len -= len;
+	while (len) {
+		struct conn_seg *seg = \
+			list_first_entry(&b->segs, struct conn_seg, in_buf);
+		int r = min(len, seg->end - seg->start);
+		seg->start += r;
+		len -= r;
+		if (seg->start == seg->end) {
+			list_del(&seg->in_buf);
+			buffer_free(c->domain, (char*)seg);
+		}
+	}
+}
+
+static void buf_append(struct conn *c, struct conn_buf *b,
+		       const char *data, int len)
+{
+	b->len += len;
+	while (len) {
+		struct conn_seg *seg = NULL;
+		if (!list_empty(&b->segs)) {
+			seg = list_entry(b->segs.prev, struct conn_seg, in_buf);
+		}
+		if (!seg || seg->end == SEG_DATA_SZ) {
+			seg = seg_new(c);
+			list_add_tail(&seg->in_buf, &b->segs);
+		}
+		int r = min(len, SEG_DATA_SZ - seg->end);
+		memcpy(seg->data + seg->end, data, r);
+		seg->end += r;
+		data += r;
+		len -= r;
+	}
+}
+
+static int buf_iov(struct conn_buf *b, struct iovec *iov, int iovcnt)
+{
+	int n = 0;
+	struct conn_seg *seg;
+	list_for_each_entry(seg, &b->segs, in_buf) {
+		if (n == iovcnt) {
+			break;
+		}
+		iov[n].iov_base = seg->data + seg->start;
+		iov[n].iov_len = seg->end - seg->start;
+		n++;
+	}
+	return n;
+}
+
+/* Points 'iov' at 'len' bytes from 'off'. Returns the number of iovecs
+ * or -1 if more than 'iovcnt' are needed. */
+static int buf_slice(struct conn_buf *b, int off, int len,
+		     struct iovec *iov, int iovcnt)
+{
+	int n = 0;
+	struct conn_seg *seg;
+	list_for_each_entry(seg, &b->segs, in_buf) {
+		if (len == 0) {
+			break;
+		}
+		int seg_len = seg->end - seg->start;
+		if (off >= seg_len) {
+			off -= seg_len;
+			continue;
+		}
+		if (n == iovcnt) {
+			return -1;
+		}
+		int r = min(len, seg_len - off);
+		iov[n].iov_base = seg->data + seg->start + off;
+		iov[n].iov_len = r;
+		n++;
+		off = 0;
+		len -= r;
+	}
+	return n;
+}
+
+static void buf_copy(struct conn_buf *b, char *dst, int len)
+{
+	struct conn_seg *seg;
+	list_for_each_entry(seg, &b->segs, in_buf) {
+		if (len == 0) {
+			break;
+		}
+		int r = min(len, seg->end - seg->start);
+		memcpy(dst, seg->data + seg->start, r);
+		dst += r;
+		len -= r;
+	}
+}
+
+/* Reads until EAGAIN or the high watermark. Returns MSOCK_CONN_* events. */
+static int conn_read(struct conn *c)
+{
+	int events = 0;
+	while (!c->closed) {
+		if (c->rbuf.len >= c->high_watermark) {
+			c->read_paused = 1;
+			break;
+		}
+		/* Room left in the last segment and a fresh one. */
+		struct conn_seg *last = NULL;
+		if (!list_empty(&c->rbuf.segs)) {
+			last = list_entry(c->rbuf.segs.prev,
+					  struct conn_seg, in_buf);
+		}
+		struct conn_seg *seg = seg_new(c);
+		struct iovec iov[2];
+		int n = 0;
+		if (last && last->end < SEG_DATA_SZ) {
+			iov[n].iov_base = last->data + last->end;
+			iov[n].iov_len = SEG_DATA_SZ - last->end;
+			n++;
+		}
+		iov[n].iov_base = seg->data;
+		iov[n].iov_len = SEG_DATA_SZ;
+		ssize_t want = SEG_DATA_SZ + (n ? iov[0].iov_len : 0);
+		n++;
+
+		ssize_t r = readv(c->fd, iov, n);
+		if (r > 0) {
+			ssize_t left = r;
+			if (n == 2) {
+				int l = min(left, (ssize_t)iov[0].iov_len);
+				last->end += l;
+				left -= l;
+			}
+			if (left) {
+				seg->end = left;
+				list_add_tail(&seg->in_buf, &c->rbuf.segs);
+			} else {
+				buffer_free(c->domain, (char*)seg);
+			}
+			c->rbuf.len += r;
+			events |= MSOCK_CONN_READABLE;
+			if (r < want) {
+				/* Socket drained, the next data makes a new
+				 * edge. Saves the EAGAIN round. */
+				break;
+			}
+			continue;
+		}
+		buffer_free(c->domain, (char*)seg);
+		if (r == -1 && errno == EINTR) {
+			continue;
+		}
+		if (r == -1 && errno == EAGAIN) {
+			break;
+		}
+		c->closed = 1;
+		events |= MSOCK_CONN_CLOSED;
+	}
+	return events;
+}
+
+/* Sends the write buffer until EAGAIN. Returns -1 if the connection
+ * broke. */
+static int conn_flush(struct conn *c)
+{
+	while (c->wbuf.len && !c->closed) {
+		struct iovec iov[CONN_IOV];
+		struct msghdr mh;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = iov;
+		mh.msg_iovlen = buf_iov(&c->wbuf, iov, CONN_IOV);
+		ssize_t want = 0;
+		int i;
+		for (i=0; i < mh.msg_iovlen; i++) {
+			want += iov[i].iov_len;
+		}
+
+		ssize_t r = sendmsg(c->fd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				break;
+			}
+			c->closed = 1;
+			return -1;
+		}
+		buf_drop(c, &c->wbuf, r);
+		if (r < want) {
+			/* Socket buffer is full. */
+			break;
+		}
+	}
+	return c->closed ? -1 : 0;
+}
+
+DLL_PUBLIC msock_conn msock_conn_new(int fd, int high_watermark,
+				     int low_watermark)
+{
+	struct conn *c = type_malloc(struct conn);
+	c->fd = fd;
+	c->high_watermark = high_watermark ? high_watermark : CONN_HIGH_WATERMARK;
+	c->low_watermark = low_watermark ? low_watermark : CONN_LOW_WATERMARK;
+	c->domain = get_current_process()->domain;
+	INIT_LIST_HEAD(&c->in_corked);
+	INIT_LIST_HEAD(&c->rbuf.segs);
+	INIT_LIST_HEAD(&c->wbuf.segs);
+	msock_send_msg_fd(MSG_FD_SUBSCRIBE, fd, 0);
+	return c;
+}
+
+DLL_PUBLIC void msock_conn_free(msock_conn conn)
+{
+	struct conn *c = conn;
+	/* Written just before closing. */
+	list_del_init(&c->in_corked);
+	conn_flush(c);
+	msock_send_msg_fd(MSG_FD_UNREGISTER, c->fd, 0);
+	close(c->fd);
+	buf_drop(c, &c->rbuf, c->rbuf.len);
+	buf_drop(c, &c->wbuf, c->wbuf.len);
+	type_free(struct conn, c);
+}
+
+DLL_PUBLIC int msock_conn_fd(msock_conn conn)
+{
+	return ((struct conn *)conn)->fd;
+}
+
+static int conn_events(struct conn *c, int fd_events)
+{
+	int events = 0;
+	if (fd_events & MSOCK_FD_EV_READ) {
+		events |= conn_read(c);
+	}
+	if (fd_events & MSOCK_FD_EV_WRITE) {
+		conn_flush(c);
+		if (c->write_blocked && c->wbuf.len <= c->low_watermark) {
+			c->write_blocked = 0;
+			events |= MSOCK_CONN_WRITABLE;
+		}
+	}
+	if (fd_events & MSOCK_FD_EV_CLOSE || c->closed) {
+		c->closed = 1;
+		events |= MSOCK_CONN_CLOSED;
+	}
+	return events;
+}
+
+DLL_PUBLIC int msock_conn_handle(msock_conn conn, int msg_type,
+				 void *msg_payload)
+{
+	struct conn *c = conn;
+	switch (msg_type) {
+	case MSG_FD_READ:
+		return conn_events(c, MSOCK_FD_EV_READ);
+	case MSG_FD_WRITE:
+		return conn_events(c, MSOCK_FD_EV_WRITE);
+	case MSG_FD_CLOSE:
+		return conn_events(c, MSOCK_FD_EV_CLOSE);
+	case MSG_FD_READY_BATCH: {
+		struct msock_msg_fd_batch *msg = \
+			(struct msock_msg_fd_batch *)msg_payload;
+		int i;
+		for (i=0; i < msg->count; i++) {
+			if (msg->items[i].fd == c->fd) {
+				return conn_events(c, msg->items[i].events);
+			}
+		}
+		return 0; }
+	default:
+		fatal("Broken message %#x", msg_type);
+	}
+	return 0;
+}
+
+DLL_PUBLIC int msock_conn_rlen(msock_conn conn)
+{
+	return ((struct conn *)conn)->rbuf.len;
+}
+
+DLL_PUBLIC int msock_conn_peek(msock_conn conn, struct iovec *iov, int iovcnt)
+{
+	return buf_iov(&((struct conn *)conn)->rbuf, iov, iovcnt);
+}
+
+static void conn_resume_read(struct conn *c)
+{
+	if (c->read_paused) {
+		/* The edge was already reported, subscribing again re-arms
+		 * it. */
+		c->read_paused = 0;
+		msock_send_msg_fd(MSG_FD_SUBSCRIBE, c->fd, 0);
+	}
+}
+
+DLL_PUBLIC void msock_conn_consume(msock_conn conn, int len)
+{
+	struct conn *c = conn;
+	buf_drop(c, &c->rbuf, len);
+	c->scanned = max(c->scanned - len, 0);
+	if (c->rbuf.len <= c->low_watermark) {
+		conn_resume_read(c);
+	}
+}
+
+DLL_PUBLIC int msock_conn_read(msock_conn conn, char *buf, int len)
+{
+	struct conn *c = conn;
+	len = min(len, c->rbuf.len);
+	buf_copy(&c->rbuf, buf, len);
+	msock_conn_consume(conn, len);
+	return len;
+}
+
+/* Frame can't be completed if the read buffer is full. */
+static int frame_too_big(struct conn *c, int frame_len)
+{
+	if (frame_len > c->high_watermark) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	return 0;
+}
+
+/* The rest of the frame has to be read, even if reading paused above
+ * the low watermark. */
+static int frame_wait(struct conn *c)
+{
+	conn_resume_read(c);
+	return 0;
+}
+
+static int frame_slice(struct conn *c, int off, int len,
+		       struct iovec *iov, int *iovcnt)
+{
+	int n = buf_slice(&c->rbuf, off, len, iov, *iovcnt);
+	if (n == -1) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	*iovcnt = n;
+	return 0;
+}
+
+DLL_PUBLIC int msock_conn_frame_delim(msock_conn conn, char delim,
+				      struct iovec *iov, int *iovcnt)
+{
+	struct conn *c = conn;
+	/* Pick up where the last look ended. */
+	int pos = 0;
+	int found = -1;
+	struct conn_seg *seg;
+	list_for_each_entry(seg, &c->rbuf.segs, in_buf) {
+		int seg_len = seg->end - seg->start;
+		if (pos + seg_len > c->scanned) {
+			const char *base = seg->data + seg->start;
+			const char *p = scan_byte(base + max(c->scanned - pos, 0),
+						  base + seg_len, delim);
+			if (p) {
+				found = pos + (p - base);
+				break;
+			}
+		}
+		pos += seg_len;
+	}
+	if (found == -1) {
+		c->scanned = c->rbuf.len;
+		if (frame_too_big(c, c->rbuf.len + 1) == -1) {
+			return -1;
+		}
+		return frame_wait(c);
+	}
+	c->scanned = found;
+	if (frame_slice(c, 0, found, iov, iovcnt) == -1) {
+		return -1;
+	}
+	return found + 1;
+}
+
+DLL_PUBLIC int msock_conn_frame_prefix(msock_conn conn, int prefix_sz,
+				       struct iovec *iov, int *iovcnt)
+{
+	struct conn *c = conn;
+	if (prefix_sz < 1 || prefix_sz > 4) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (c->rbuf.len < prefix_sz) {
+		return frame_wait(c);
+	}
+	unsigned char prefix[4];
+	buf_copy(&c->rbuf, (char*)prefix, prefix_sz);
+	uint32_t len = 0;
+	int i;
+	for (i=0; i < prefix_sz; i++) {
+		len = (len << 8) | prefix[i];
+	}
+	if (len > (uint32_t)c->high_watermark ||
+	    frame_too_big(c, prefix_sz + len) == -1) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (c->rbuf.len < prefix_sz + (int)len) {
+		return frame_wait(c);
+	}
+	if (frame_slice(c, prefix_sz, len, iov, iovcnt) == -1) {
+		return -1;
+	}
+	return prefix_sz + len;
+}
+
+DLL_PUBLIC int msock_conn_writev(msock_conn conn, const struct iovec *iov,
+				 int iovcnt)
+{
+	struct conn *c = conn;
+	if (c->closed) {
+		errno = EPIPE;
+		return -1;
+	}
+	int i;
+	for (i=0; i < iovcnt; i++) {
+		buf_append(c, &c->wbuf, iov[i].iov_base, iov[i].iov_len);
+	}
+	if (c->wbuf.len >= c->high_watermark) {
+		/* Nothing to gain from waiting. */
+		list_del_init(&c->in_corked);
+		if (conn_flush(c) == -1) {
+			return -1;
+		}
+		if (c->wbuf.len >= c->high_watermark) {
+			c->write_blocked = 1;
+		}
+	} else if (list_empty(&c->in_corked)) {
+		list_add_tail(&c->in_corked, &c->domain->list_of_corked_conns);
+	}
+	return c->write_blocked;
+}
+
+DLL_PUBLIC int msock_conn_write(msock_conn conn, const char *buf, int len)
+{
+	struct iovec iov;
+	iov.iov_base = (void*)buf;
+	iov.iov_len = len;
+	return msock_conn_writev(conn, &iov, 1);
+}
+
+DLL_PUBLIC int msock_conn_flush(msock_conn conn)
+{
+	struct conn *c = conn;
+	list_del_init(&c->in_corked);
+	if (c->closed) {
+		errno = EPIPE;
+		return -1;
+	}
+	return conn_flush(c);
+}
+
+/* End of the domain run: every connection goes out in one sendmsg().
+ * Errors show up as MSOCK_CONN_CLOSED with the next event. */
+DLL_LOCAL void conns_uncork(struct domain *domain)
+{
+	struct conn *c, *safe;
+	list_for_each_entry_safe(c, safe, &domain->list_of_corked_conns,
+				 in_corked) {
+		list_del_init(&c->in_corked);
+		conn_flush(c);
+	}
+}
+
+DLL_PUBLIC int msock_conn_wlen(msock_conn conn)
+{
+	return ((struct conn *)conn)->wbuf.len;
+}
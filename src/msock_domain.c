@@ -45,10 +45,13 @@ DLL_LOCAL struct domain *domain_new(struct base *base,
 
 	INIT_LIST_HEAD(&domain->list_of_processes);
 	INIT_LIST_HEAD(&domain->list_of_hungry_processes);
+	INIT_LIST_HEAD(&domain->list_of_corked_conns);
+	domain->pipes_kept = 0;
 	INIT_QUEUE_ROOT(&domain->queue_of_busy_processes);
 
 	INIT_MEM_CACHE(&domain->cache_messages, &base->zone_messages);
 	INIT_MEM_CACHE(&domain->cache_processes, &base->zone_processes);
+	INIT_MEM_CACHE(&domain->cache_buffers, &base->zone_buffers);
 
 	int i;
 	for (i=0; i < ARRAY_SIZE(domain->outbox); i++) {
@@ -69,6 +72,8 @@ DLL_LOCAL void domain_free(struct domain *domain)
 	drain_message_queue(domain, &domain->remote_inbox);
 	drain_message_queue(domain, &domain->local_inbox);
 
+	pipes_free(domain);
+
 	domain->base->gid_to_domain[domain->gid] = NULL;
 	list_del(&domain->in_list);
 
@@ -76,6 +81,7 @@ DLL_LOCAL void domain_free(struct domain *domain)
 
 	cache_drain(&domain->cache_messages);
 	cache_drain(&domain->cache_processes);
+	cache_drain(&domain->cache_buffers);
 
 	type_free(struct domain, domain);
 }
@@ -117,6 +123,8 @@ static void dispatch_special(struct domain *domain, struct message *msg)
 
 		cache_drain(&domain->cache_messages);
 		cache_drain(&domain->cache_processes);
+		cache_drain(&domain->cache_buffers);
+		domain->buffers_freed = 0;
 	} else {
 		abort();
 	}
@@ -135,7 +143,7 @@ DLL_LOCAL int dispatch_msg_local(struct domain *domain,
 			counter ++;
 			dispatch_msg_single(process, msg);
 		} else { // process == NULL
-			cache_free(&domain->cache_messages, struct message, msg);
+			message_drop(domain, msg);
 		}
 	} else { // poff == 0,  aka broadcast
 		counter ++;
@@ -199,6 +207,9 @@ DLL_LOCAL int domain_run(struct domain *domain)
 			break;
 		}
 	}
+	if (!list_empty(&domain->list_of_corked_conns)) {
+		conns_uncork(domain);
+	}
 
 	return send_flush_outbox(domain);
 }
@@ -1,6 +1,9 @@
 #ifndef _MSOCK_DOMAIN_H
 #define _MSOCK_DOMAIN_H
 
+/* Empty pipes of msock_pipe_fds() kept for reuse, per domain. */
+#define PIPES_KEPT (8)
+
 struct domain {
 	spinlock_t lock;
 	struct umap_root *poff_to_process;
@@ -8,6 +11,10 @@ struct domain {
 
 	struct mem_cache cache_messages;
 	struct mem_cache cache_processes;
+	struct mem_cache cache_buffers;
+	/* Buffers usually come from other domain, return them to the
+	 * zone from time to time. */
+	int buffers_freed;
 
 	spinlock_t remote_inbox_lock;
 	struct queue_root remote_inbox;
@@ -24,6 +31,10 @@ struct domain {
 
 	struct list_head list_of_processes;
 	struct list_head list_of_hungry_processes;
+	/* Connections written to during this run, sent at its end. */
+	struct list_head list_of_corked_conns;
+	int pipes_kept;
+	int pipes[PIPES_KEPT][2];
 
 	struct queue_root outbox[MAX_DOMAINS];
 };
@@ -39,6 +50,11 @@ DLL_LOCAL int count_hungry_domains(struct base *base);
 
 DLL_LOCAL int dispatch_msg_local(struct domain *domain, struct message *msg);
 
+/* msock_conn.c */
+DLL_LOCAL void conns_uncork(struct domain *domain);
+/* msock_pipe.c */
+DLL_LOCAL void pipes_free(struct domain *domain);
+
 
 DLL_LOCAL extern __thread struct process *_current_process;
 
@@ -7,24 +7,67 @@
 
 struct local_data;
 
+/* Items are allocated lazily, in chunks, on first use of an fd. */
+#define FD_CHUNK_BITS (6)
+#define FD_CHUNK_SZ (1 << FD_CHUNK_BITS)
+#define FD_CHUNK_MASK (FD_CHUNK_SZ - 1)
+
+/* Read and write registrations are independent, can have different
+ * owners and timeouts. */
+struct local_interest {
+	msock_pid_t victim;
+	struct timer_head timer;
+};
+
 struct local_item {
 	struct list_head in_list;
 	int fd;
 	int new_mask;
 	int epoll_mask;
-	msock_pid_t victim;
+	/* Read interest wants the data, not readiness: 0 or the
+	 * MSG_FD_REGISTER_RECV* message. */
+	int recv;
+	/* Interests ended the way after which fds get closed: end of
+	 * stream, error, timeout or unregister. The number could have been
+	 * reused since the last change reached the kernel. */
+	int dropped;
 	struct local_data *sd;
-	struct timer_head timer;
+	struct local_interest rd;
+	struct local_interest wr;
+};
+
+/* Grows when epoll_wait() fills it up. */
+#define EVENTS_MIN_SZ (256)
+#define EVENTS_MAX_SZ (16384)
+
+/* Events for one victim, collected during a single epoll_wait() round. */
+#define BATCH_SLOTS (512)
+
+struct batch_slot {
+	msock_pid_t victim;
+	struct msock_msg_fd_batch msg;
 };
 
 struct local_data {
+	struct base *base;
 	int epfd;
 	int pipe_read;
+	int events_sz;
+	struct epoll_event *events;
+	int busy_poll_usecs;
 	int map_sz;
-	struct local_item *map;
+	int chunks_sz;
+	struct local_item **chunks;
 
 	struct list_head changed;
 	struct timer_base tbase;
+
+	int batch;
+	struct batch_slot *batch_slots;
+	int batch_used_sz;
+	int batch_used[BATCH_SLOTS/2];
+
+	struct dgram_stash dgrams;
 };
 
 static int process_callback(int msg_type,
@@ -33,28 +76,28 @@ static int process_callback(int msg_type,
 			    void *process_data);
 
 static void schedule_change(struct local_data *sd,
-			    msock_pid_t victim,
-			    int fd,
-			    int new_mask,
-			    unsigned long expires);
-
-static void timer_callback(struct timer_head *timer);
-
-static void epoll_constructor(struct base *base,
-			      struct engine_proto *proto,
-			      int user_max_processes)
+			    struct local_item *li,
+			    int new_mask);
+static void interest_set(struct local_data *sd,
+			 struct local_interest *in,
+			 msock_pid_t victim,
+			 unsigned long expires);
+static struct local_item *fd_to_item_alloc(struct local_data *sd, int fd);
+
+static void timer_read_callback(struct timer_head *timer);
+static void timer_write_callback(struct timer_head *timer);
+
+static msock_pid_t epoll_engine_new(struct base *base,
+				    struct engine_proto *proto)
 {
 	struct local_data *sd = type_malloc(struct local_data);
 	sd->map_sz = get_max_open_files();
-	sd->map = (struct local_item*) \
-		msock_safe_malloc(sizeof(struct local_item) * sd->map_sz);
-	int i;
-	for (i=0; i < sd->map_sz; i++) {
-		struct local_item *li = &sd->map[i];
-		li->fd = i;
-		INIT_LIST_HEAD(&li->in_list);
-		INIT_TIMER_HEAD(&sd->map[i].timer, timer_callback);
-		li->sd = sd;
+	sd->chunks_sz = (sd->map_sz + FD_CHUNK_SZ - 1) / FD_CHUNK_SZ;
+	/* Untouched pages of calloc() don't cost us anything. */
+	sd->chunks = (struct local_item**) \
+		calloc(sd->chunks_sz, sizeof(struct local_item*));
+	if (sd->chunks == NULL) {
+		pfatal("calloc()");
 	}
 
 	sd->epfd = epoll_create(128);
@@ -63,6 +106,18 @@ static void epoll_constructor(struct base *base,
 	}
 	INIT_LIST_HEAD(&sd->changed);
 
+	sd->base = base;
+	sd->events_sz = EVENTS_MIN_SZ;
+	sd->events = (struct epoll_event*) \
+		msock_safe_malloc(sizeof(struct epoll_event) * sd->events_sz);
+	sd->busy_poll_usecs = base->options.select_busy_poll_usecs;
+
+	sd->batch = base->options.select_batch;
+	if (sd->batch) {
+		sd->batch_slots = (struct batch_slot*) \
+			msock_safe_malloc(sizeof(struct batch_slot) * BATCH_SLOTS);
+	}
+
 	set_msock_now_msecs();
 
 	INIT_TIMER_BASE(&sd->tbase, msock_now_msecs);
@@ -77,16 +132,48 @@ static void epoll_constructor(struct base *base,
 
 	struct domain *domain = domain_new(base, proto, (void*)(long)pipefd[1], 1);
 	msock_pid_t pid = spawn(domain, process_callback, sd, PROCOPT_HUNGRY);
-	msock_register(domain->base, pid, PID_SELECT);
 
-	schedule_change(sd, pid, sd->pipe_read, EPOLLIN, 0);
+	struct local_item *li = fd_to_item_alloc(sd, sd->pipe_read);
+	interest_set(sd, &li->rd, pid, 0);
+	schedule_change(sd, li, EPOLLIN);
+	return pid;
+}
+
+static void epoll_constructor(struct base *base,
+			      struct engine_proto *proto,
+			      int user_max_processes)
+{
+	int engines = max(1, base->options.select_engines);
+	if (engines > ARRAY_SIZE(base->select_pids)) {
+		fatal("Too many select engines.");
+	}
+
+	int i;
+	for (i=0; i < engines; i++) {
+		base->select_pids[i] = epoll_engine_new(base, proto);
+	}
+	base->select_engines = engines;
+	msock_register(base, base->select_pids[0], PID_SELECT);
 }
 
 static void epoll_data_free(struct local_data *sd)
 {
+	dgram_stash_free(get_current_process()->domain, &sd->dgrams);
 	close(sd->epfd);
 	close(sd->pipe_read);
-	msock_safe_free(sizeof(struct local_item) * sd->map_sz, sd->map);
+	int i;
+	for (i=0; i < sd->chunks_sz; i++) {
+		if (sd->chunks[i]) {
+			msock_safe_free(sizeof(struct local_item) * FD_CHUNK_SZ,
+					sd->chunks[i]);
+		}
+	}
+	free(sd->chunks);
+	msock_safe_free(sizeof(struct epoll_event) * sd->events_sz, sd->events);
+	if (sd->batch_slots) {
+		msock_safe_free(sizeof(struct batch_slot) * BATCH_SLOTS,
+				sd->batch_slots);
+	}
 	type_free(struct local_data, sd);
 }
 
@@ -115,16 +202,67 @@ static struct engine_proto engine_epoll = {
 REGISTER_ENGINE(MSOCK_ENGINE_MASK_SELECT, &engine_epoll);
 
 
+static struct local_item *chunk_alloc(struct local_data *sd, int fd)
+{
+	struct local_item *chunk = (struct local_item*) \
+		msock_safe_malloc(sizeof(struct local_item) * FD_CHUNK_SZ);
+	int base_fd = fd & ~FD_CHUNK_MASK;
+	int i;
+	for (i=0; i < FD_CHUNK_SZ; i++) {
+		struct local_item *li = &chunk[i];
+		li->fd = base_fd + i;
+		INIT_LIST_HEAD(&li->in_list);
+		INIT_TIMER_HEAD(&li->rd.timer, timer_read_callback);
+		INIT_TIMER_HEAD(&li->wr.timer, timer_write_callback);
+		li->sd = sd;
+	}
+	sd->chunks[fd >> FD_CHUNK_BITS] = chunk;
+	return chunk;
+}
+
+/* Item for an fd that was registered before. */
+static inline struct local_item *fd_to_item(struct local_data *sd, int fd)
+{
+	return &sd->chunks[fd >> FD_CHUNK_BITS][fd & FD_CHUNK_MASK];
+}
+
+/* Item for an fd, NULL if none was ever allocated for it. */
+static inline struct local_item *fd_to_item_lookup(struct local_data *sd,
+						   int fd)
+{
+	if (unlikely(fd < 0 || fd >= sd->map_sz)) {
+		return NULL;
+	}
+	struct local_item *chunk = sd->chunks[fd >> FD_CHUNK_BITS];
+	if (unlikely(chunk == NULL)) {
+		return NULL;
+	}
+	return &chunk[fd & FD_CHUNK_MASK];
+}
+
+static struct local_item *fd_to_item_alloc(struct local_data *sd, int fd)
+{
+	if (unlikely(fd < 0 || fd >= sd->map_sz)) {
+		fatal("Bad fd %i.", fd);
+	}
+	struct local_item *chunk = sd->chunks[fd >> FD_CHUNK_BITS];
+	if (unlikely(chunk == NULL)) {
+		chunk = chunk_alloc(sd, fd);
+	}
+	return &chunk[fd & FD_CHUNK_MASK];
+}
+
+
 static void schedule_change(struct local_data *sd,
-			    msock_pid_t victim,
-			    int fd,
-			    int new_mask,
-			    unsigned long expires)
+			    struct local_item *li,
+			    int new_mask)
 {
-	struct local_item *li = &sd->map[fd];
-	li->victim = victim;
 	li->new_mask = new_mask;
-	if (li->new_mask == li->epoll_mask) {
+	/* Edge triggered registration is always passed to the kernel, it
+	 * re-arms the notifications. So is registering an fd that might
+	 * have been closed: the kernel forgot it then. */
+	if (li->new_mask == li->epoll_mask && !(new_mask & EPOLLET) &&
+	    !(li->dropped && new_mask)) {
 		if (!list_empty(&li->in_list)) {
 			list_del_init(&li->in_list);
 		}
@@ -134,23 +272,71 @@ static void schedule_change(struct local_data *sd,
 				      &sd->changed);
 		}
 	}
-	if (expires) {
-		timer_add(&li->timer,
+}
+
+static void interest_set(struct local_data *sd,
+			 struct local_interest *in,
+			 msock_pid_t victim,
+			 unsigned long expires)
+{
+	in->victim = victim;
+	if (victim && expires) {
+		timer_add(&in->timer,
 			  expires,
 			  &sd->tbase);
 	} else {
-		timer_del(&li->timer);
+		timer_del(&in->timer);
 	}
 }
 
-static void timer_callback(struct timer_head *timer) {
-	struct local_item *item = \
-		container_of(timer, struct local_item, timer);
+/* Epoll mask for current interests, keeps subscription edge triggered. */
+static int item_mask(struct local_item *li)
+{
+	int mask = 0;
+	if (li->rd.victim) {
+		mask |= EPOLLIN | EPOLLRDHUP;
+	}
+	if (li->wr.victim) {
+		mask |= EPOLLOUT;
+	}
+	if (mask && (li->new_mask & EPOLLET)) {
+		mask |= EPOLLET;
+	}
+	return mask;
+}
+
+static void item_clear(struct local_data *sd, struct local_item *li)
+{
+	interest_set(sd, &li->rd, NULL, 0);
+	interest_set(sd, &li->wr, NULL, 0);
+	schedule_change(sd, li, 0);
+}
+
+static void interest_timeout(struct local_item *li, struct local_interest *in)
+{
 	struct msock_msg_fd msg;
-	msg.fd = item->fd;
+	msg.fd = li->fd;
 	msg.victim = NULL;
-	msock_send(item->victim, MSG_FD_TIMEOUTED, (void*)&msg, sizeof(msg));
-	schedule_change(item->sd, item->victim, item->fd, 0, 0);
+	msock_send(in->victim, MSG_FD_TIMEOUTED, (void*)&msg, sizeof(msg));
+	li->dropped = 1;
+	if (li->new_mask & EPOLLET) {
+		item_clear(li->sd, li);
+	} else {
+		interest_set(li->sd, in, NULL, 0);
+		schedule_change(li->sd, li, item_mask(li));
+	}
+}
+
+static void timer_read_callback(struct timer_head *timer) {
+	struct local_item *li = \
+		container_of(timer, struct local_item, rd.timer);
+	interest_timeout(li, &li->rd);
+}
+
+static void timer_write_callback(struct timer_head *timer) {
+	struct local_item *li = \
+		container_of(timer, struct local_item, wr.timer);
+	interest_timeout(li, &li->wr);
 }
 
 static void send_msg_helper(msock_pid_t victim, int msg_type, int fd) {
@@ -160,6 +346,215 @@ static void send_msg_helper(msock_pid_t victim, int msg_type, int fd) {
 	msock_send(victim, msg_type, (void*)&msg, sizeof(msg));
 }
 
+static void batch_flush_slot(struct batch_slot *bs)
+{
+	struct msock_msg_fd_batch *msg = &bs->msg;
+	if (msg->count == 1) {
+		/* Nothing to gain, use normal messages. */
+		int fd = msg->items[0].fd;
+		int events = msg->items[0].events;
+		if (events & MSOCK_FD_EV_READ) {
+			send_msg_helper(bs->victim, MSG_FD_READ, fd);
+		}
+		if (events & MSOCK_FD_EV_WRITE) {
+			send_msg_helper(bs->victim, MSG_FD_WRITE, fd);
+		}
+		if (events & MSOCK_FD_EV_CLOSE) {
+			send_msg_helper(bs->victim, MSG_FD_CLOSE, fd);
+		}
+	} else if (msg->count > 1) {
+		msock_send(bs->victim, MSG_FD_READY_BATCH, (void*)msg,
+			   sizeof(int) +
+			   sizeof(struct msock_msg_fd_batch_item) * msg->count);
+	}
+	msg->count = 0;
+}
+
+static void batch_flush(struct local_data *sd)
+{
+	int i;
+	for (i=0; i < sd->batch_used_sz; i++) {
+		struct batch_slot *bs = &sd->batch_slots[sd->batch_used[i]];
+		batch_flush_slot(bs);
+		bs->victim = NULL;
+	}
+	sd->batch_used_sz = 0;
+}
+
+static void batch_add(struct local_data *sd, msock_pid_t victim,
+		      int msg_type, int fd)
+{
+	if (unlikely(sd->batch_used_sz == ARRAY_SIZE(sd->batch_used))) {
+		batch_flush(sd);
+	}
+
+	unsigned long h = (unsigned long)victim * 0x9E3779B97F4A7C15UL;
+	int idx = h >> (sizeof(unsigned long)*8 - 9);
+	struct batch_slot *bs;
+	while (1) {
+		bs = &sd->batch_slots[idx];
+		if (bs->victim == victim) {
+			break;
+		}
+		if (bs->victim == NULL) {
+			bs->victim = victim;
+			sd->batch_used[sd->batch_used_sz++] = idx;
+			break;
+		}
+		idx = (idx + 1) % BATCH_SLOTS;
+	}
+
+	int ev;
+	switch (msg_type) {
+	case MSG_FD_READ: ev = MSOCK_FD_EV_READ; break;
+	case MSG_FD_WRITE: ev = MSOCK_FD_EV_WRITE; break;
+	default: ev = MSOCK_FD_EV_CLOSE; break;
+	}
+
+	struct msock_msg_fd_batch *msg = &bs->msg;
+	/* Events for an fd come together. */
+	if (msg->count && msg->items[msg->count-1].fd == fd) {
+		msg->items[msg->count-1].events |= ev;
+		return;
+	}
+	if (msg->count == MSOCK_FD_BATCH_MAX) {
+		batch_flush_slot(bs);
+	}
+	msg->items[msg->count].fd = fd;
+	msg->items[msg->count].events = ev;
+	msg->count++;
+}
+
+static void send_event(struct local_data *sd, msock_pid_t victim,
+		       int msg_type, int fd)
+{
+	if (sd->batch) {
+		batch_add(sd, victim, msg_type, fd);
+	} else {
+		send_msg_helper(victim, msg_type, fd);
+	}
+}
+
+static void send_recv_msg(msock_pid_t victim, int fd, int len,
+			  int saved_errno, char *buf)
+{
+	struct msock_msg_fd_recv msg;
+	msg.fd = fd;
+	msg.len = len;
+	msg.saved_errno = saved_errno;
+	msg.buf = buf;
+	msock_send(victim, MSG_FD_RECV, (void*)&msg, sizeof(msg));
+}
+
+/* Reads the data for MSG_FD_REGISTER_RECV*. Returns 0 if there was
+ * nothing to read after all, -1 if the stream ended and 1 otherwise. */
+static int recv_to_victim(struct local_item *li)
+{
+	struct domain *domain = get_current_process()->domain;
+	if (li->recv == MSG_FD_REGISTER_RECV_DGRAMS) {
+		return dgrams_recv(domain, &li->sd->dgrams, li->fd,
+				   li->rd.victim);
+	}
+	char *buf = buffer_alloc(domain);
+
+	int r = read(li->fd, buf, MSOCK_BUF_SZ);
+	if (r > 0) {
+		send_recv_msg(li->rd.victim, li->fd, r, 0, buf);
+		return 1;
+	}
+	buffer_free(domain, buf);
+	if (r == -1 && (errno == EAGAIN || errno == EINTR)) {
+		return 0;
+	}
+	send_recv_msg(li->rd.victim, li->fd, r, r == -1 ? errno : 0, NULL);
+	return -1;
+}
+
+/* Edge triggered: every edge must be reported, registration stays. */
+static void process_event_persistent(struct local_item *li, int events)
+{
+	if (events & (EPOLLIN | EPOLLOUT)) {
+		if (events & EPOLLIN) {
+			send_event(li->sd, li->rd.victim, MSG_FD_READ, li->fd);
+		}
+		if (events & EPOLLOUT) {
+			send_event(li->sd, li->wr.victim, MSG_FD_WRITE, li->fd);
+		}
+	} else if (events & (EPOLLERR | EPOLLHUP)) {
+		send_event(li->sd, li->rd.victim, MSG_FD_CLOSE, li->fd);
+	} else {
+		fatal("ftf?");
+	}
+}
+
+/* One shot: satisfied interests are dropped, the other one stays. */
+static void process_event(struct local_data *sd, struct local_item *li,
+			  int events)
+{
+	int error = events & (EPOLLERR | EPOLLHUP);
+	msock_pid_t closed = NULL;
+
+	if (events & (EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+		li->dropped = 1;
+	}
+
+	if (li->rd.victim && li->recv && (events & EPOLLIN || error)) {
+		int r = recv_to_victim(li);
+		if (r != 0) {
+			if (r == -1) {
+				closed = li->rd.victim;
+				li->dropped = 1;
+			}
+			interest_set(sd, &li->rd, NULL, 0);
+		}
+	} else if (li->rd.victim && (events & EPOLLIN || error)) {
+		if (events & EPOLLIN) {
+			send_event(sd, li->rd.victim, MSG_FD_READ, li->fd);
+		} else {
+			send_event(sd, li->rd.victim, MSG_FD_CLOSE, li->fd);
+			closed = li->rd.victim;
+		}
+		interest_set(sd, &li->rd, NULL, 0);
+	}
+	if (li->wr.victim && (events & EPOLLOUT || error)) {
+		if (events & EPOLLOUT) {
+			send_event(sd, li->wr.victim, MSG_FD_WRITE, li->fd);
+		} else if (li->wr.victim != closed) {
+			send_event(sd, li->wr.victim, MSG_FD_CLOSE, li->fd);
+		}
+		interest_set(sd, &li->wr, NULL, 0);
+	}
+	schedule_change(sd, li, item_mask(li));
+}
+
+/* Poll without sleeping for a while. Returns -1 with errno, 0 if nothing
+ * came during the spin or number of events. */
+static int busy_poll(struct local_data *sd, long delta_msecs)
+{
+	unsigned long long spin = min((unsigned long long)sd->busy_poll_usecs,
+				      (unsigned long long)delta_msecs * 1000);
+	unsigned long long t0 = now_usecs();
+	unsigned long long t1;
+	int r;
+	while (1) {
+		r = epoll_wait(sd->epfd, sd->events, sd->events_sz, 0);
+		t1 = now_usecs();
+		if (r != 0 || t1 - t0 >= spin) {
+			break;
+		}
+	}
+	__sync_fetch_and_add(&sd->base->select_busy_poll_usecs, t1 - t0);
+	return r;
+}
+
+static void events_grow(struct local_data *sd)
+{
+	msock_safe_free(sizeof(struct epoll_event) * sd->events_sz, sd->events);
+	sd->events_sz *= 2;
+	sd->events = (struct epoll_event*) \
+		msock_safe_malloc(sizeof(struct epoll_event) * sd->events_sz);
+}
+
 static void process_block(struct local_data *sd)
 {
 	int r = 0;
@@ -172,6 +567,7 @@ static void process_block(struct local_data *sd)
 		struct local_item *li = \
 			container_of(head, struct local_item, in_list);
 		list_del_init(&li->in_list);
+		li->dropped = 0;
 		if (li->new_mask) {
 			ev.events = li->new_mask;
 			ev.data.fd = li->fd;
@@ -179,13 +575,19 @@ static void process_block(struct local_data *sd)
 				r = epoll_ctl(sd->epfd, EPOLL_CTL_ADD, li->fd, &ev);
 			} else {
 				r = epoll_ctl(sd->epfd, EPOLL_CTL_MOD, li->fd, &ev);
+				/* Fd was closed while registered and the
+				 * number got reused. */
+				if (r == -1 && errno == ENOENT) {
+					r = epoll_ctl(sd->epfd, EPOLL_CTL_ADD,
+						      li->fd, &ev);
+				}
 			}
 		} else {
 			if (!li->epoll_mask) {
 				fatal("wtf?");
 			} else {
 				r = epoll_ctl(sd->epfd, EPOLL_CTL_DEL, li->fd, &ev);
-				if (r == -1 && errno == EBADF) {
+				if (r == -1 && (errno == EBADF || errno == ENOENT)) {
 					r = 0;
 				}
 			}
@@ -201,8 +603,14 @@ do_again:;
 		timer_next_interrupt(&sd->tbase) - msock_now_msecs;
 
 	errno = 0;
-	struct epoll_event events[256];
-	r = epoll_wait(sd->epfd, events, ARRAY_SIZE(events), delta_msecs);
+	r = 0;
+	if (sd->busy_poll_usecs && (long)delta_msecs > 0) {
+		r = busy_poll(sd, delta_msecs);
+	}
+	if (r == 0) {
+		r = epoll_wait(sd->epfd, sd->events, sd->events_sz, delta_msecs);
+	}
+	struct epoll_event *events = sd->events;
 	if (r == -1) {
 		if (errno == EINTR) {
 			goto do_again;
@@ -214,26 +622,25 @@ do_again:;
 		int i;
 		for (i=0; i < r; i++) {
 			int fd = events[i].data.fd;
-			// printf("epoll fd=%i mask=0x%x %s\n", fd, events[i].events, pid_tostr(sd->map[fd].victim));
-			if (events[i].events & EPOLLIN) {
-				if (fd == sd->pipe_read) {
-					char buf[32];
-					read(fd, buf, sizeof(buf));
-					continue;
-				} else {
-					send_msg_helper(sd->map[fd].victim,
-							MSG_FD_READ, fd);
-				}
-			} else if (events[i].events & EPOLLOUT) {
-				send_msg_helper(sd->map[fd].victim,
-						MSG_FD_WRITE, fd);
-			} else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
-				send_msg_helper(sd->map[fd].victim,
-						MSG_FD_CLOSE, fd);
+			// printf("epoll fd=%i mask=0x%x %s\n", fd, events[i].events, pid_tostr(fd_to_item(sd, fd)->rd.victim));
+			if (fd == sd->pipe_read) {
+				char buf[32];
+				read(fd, buf, sizeof(buf));
+				continue;
+			}
+			struct local_item *li = fd_to_item(sd, fd);
+			if (li->epoll_mask & EPOLLET) {
+				process_event_persistent(li, events[i].events);
 			} else {
-				fatal("ftf?");
+				process_event(sd, li, events[i].events);
 			}
-			schedule_change(sd, NULL, fd, 0, 0);
+		}
+		if (sd->batch) {
+			batch_flush(sd);
+		}
+		/* More events could be waiting. */
+		if (r == sd->events_sz && sd->events_sz < EVENTS_MAX_SZ) {
+			events_grow(sd);
 		}
 	}
 
@@ -251,17 +658,49 @@ static int process_callback(int msg_type,
 {
 	struct local_data *sd = (struct local_data*)process_data;
 	struct msock_msg_fd *msg = (struct msock_msg_fd *)msg_payload;
+	struct local_item *li;
 
 	// safe_printf("msg %i %i\n", msg_type, msg->fd);
 	switch (msg_type) {
 	case MSG_FD_REGISTER_READ:
-		schedule_change(sd, msg->victim, msg->fd, EPOLLIN, msg->expires);
-		break;
 	case MSG_FD_REGISTER_WRITE:
-		schedule_change(sd, msg->victim, msg->fd, EPOLLOUT, msg->expires);
+	case MSG_FD_REGISTER_RECV:
+	case MSG_FD_REGISTER_RECV_DGRAMS:
+		li = fd_to_item_alloc(sd, msg->fd);
+		if (li->new_mask & EPOLLET) {
+			/* One shot registration replaces subscription. */
+			item_clear(sd, li);
+		}
+		interest_set(sd,
+			     msg_type == MSG_FD_REGISTER_WRITE ? &li->wr : &li->rd,
+			     msg->victim, msg->expires);
+		if (msg_type != MSG_FD_REGISTER_WRITE) {
+			li->recv = msg_type == MSG_FD_REGISTER_READ ?
+				0 : msg_type;
+		}
+		schedule_change(sd, li, item_mask(li));
 		break;
 	case MSG_FD_UNREGISTER:
-		schedule_change(sd, msg->victim, msg->fd, 0, 0);
+		/* Drop only interests of the victim. */
+		li = fd_to_item_lookup(sd, msg->fd);
+		if (li == NULL) {
+			break;
+		}
+		li->dropped = 1;
+		if (li->rd.victim == msg->victim) {
+			interest_set(sd, &li->rd, NULL, 0);
+		}
+		if (li->wr.victim == msg->victim) {
+			interest_set(sd, &li->wr, NULL, 0);
+		}
+		schedule_change(sd, li, item_mask(li));
+		break;
+	case MSG_FD_SUBSCRIBE:
+		li = fd_to_item_alloc(sd, msg->fd);
+		interest_set(sd, &li->rd, msg->victim, msg->expires);
+		interest_set(sd, &li->wr, msg->victim, 0);
+		li->recv = 0;
+		schedule_change(sd, li, EPOLLIN | EPOLLOUT | EPOLLET);
 		break;
 
 	case MSG_EXIT:
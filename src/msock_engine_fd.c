@@ -2,6 +2,16 @@
 
 #include "msock_internal.h"
 
+/* All registrations for an fd must end up in the same engine, even
+ * from owners in different domains, so the fd picks it. */
+static inline msock_pid_t fd_to_select(struct base *base, int fd)
+{
+	if (likely(base->select_engines <= 1)) {
+		return PID_SELECT;
+	}
+	return base->select_pids[fd % base->select_engines];
+}
+
 DLL_PUBLIC void msock_send_msg_fd(int msg_type,
 				  int fd,
 				  unsigned long timeout_msecs)
@@ -10,12 +20,13 @@ DLL_PUBLIC void msock_send_msg_fd(int msg_type,
 				 msg_type, fd, timeout_msecs);
 }
 
-DLL_PUBLIC void msock_base_send_msg_fd(msock_base base,
+DLL_PUBLIC void msock_base_send_msg_fd(msock_base ubase,
 				       msock_pid_t victim,
 				       int msg_type,
 				       int fd,
 				       unsigned long timeout_msecs)
 {
+	struct base *base = ubase;
 	struct msock_msg_fd msg;
 	msg.fd = fd;
 	msg.victim = victim;
@@ -25,7 +36,7 @@ DLL_PUBLIC void msock_base_send_msg_fd(msock_base base,
 		msg.expires = 0;
 	}
 	msock_base_send(base,
-			PID_SELECT,
+			fd_to_select(base, fd),
 			msg_type,
 			&msg, sizeof(msg));
 }
@@ -42,7 +53,8 @@ DLL_PUBLIC void msock_victim_send_msg_fd(msock_pid_t victim,
 	} else {
 		msg.expires = 0;
 	}
-	msock_send(PID_SELECT,
+	struct base *base = get_current_process()->domain->base;
+	msock_send(fd_to_select(base, fd),
 		   msg_type,
 		   &msg, sizeof(msg));
 }
@@ -1,25 +1,208 @@
 #include "msock_internal.h"
 
+#include <fcntl.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "io.h"
+#include "uring.h"
 
+/* Requests are run by a pool of threads, or with 'io_uring' option
+ * submitted to a ring. Requests for the same fd are run one after
+ * another, in order. Open isn't bound to any fd. */
+
+#define IO_DEFAULT_THREADS (4)
+#define IO_FD_HASH (256)
+#define IO_MAX_THREADS (64)
+#define IO_URING_ENTRIES (4096)
+#define IO_CLASSES (3)
+/* Appends in a single pwritev(), IOV_MAX on Linux. */
+#define IO_LOG_BATCH (1024)
+#define IO_DEFAULT_BUFFERS (64)
+#define IO_DEFAULT_BUFFER_SZ (128*1024)
+#define IO_BUFFER_ALIGN (4096)
+#define HUGE_PAGE_SZ (2*1024*1024)
+
+struct io_req {
+	struct list_head in_fd;		/* in io_fd->reqs */
+	struct list_head in_pool;	/* in ready or done */
+	struct io_fd *iofd;
+	int msg_type;
+	struct msock_msg_io msg;
+	/* Ring mode: already run, the ring only passes it through. */
+	int done_inline;
+	int expired;
+	unsigned long long submitted_usecs;
+	unsigned long long service_usecs;
+
+	/* Requests answered together with this one, by in_fd. Syncs
+	 * that came while this sync waited, or appends of a log batch. */
+	struct list_head batch;
+
+	/* Log batch: appends written at once. Then synced, that's stage
+	 * 1 in ring mode. */
+	struct io_log *log;
+
+	/* Read of a stream, not ordered with other requests on the fd. */
+	struct io_stream *stream;
+	unsigned long seq;
+	uint64_t batch_bytes;
+	int stage;
+};
+
+struct io_log {
+	struct list_head in_logs;	/* in io_data->logs */
+	int fd;
+	uint64_t size;
+	/* A batch is being written, new appends wait for it. */
+	int flushing;
+	int pending_sz;
+	struct list_head pending;
+};
+
+struct io_stream {
+	struct list_head in_streams;	/* in io_data->streams */
+	msock_pid_t victim;
+	int fd;
+	int chunk_sz;
+	int depth;
+	uint64_t offset;
+	unsigned long next_seq;
+	unsigned long deliver_seq;
+	int inflight;
+	/* End of file or error seen, no more reads. */
+	int ended;
+	int closed;
+	/* Finished reads waiting for the earlier ones, by seq. */
+	struct list_head done;
+	char **bufs;
+	int bufs_free_sz;
+	char **bufs_free;
+};
+
+struct io_fd {
+	struct list_head in_hash;
+	int fd;
+	/* First one is being run. */
+	struct list_head reqs;
+};
 
 struct io_data {
+	struct base *base;
 	int pipe_read;
+	int pipe_write;
+
+	/* Touched only by the engine. */
+	struct list_head fd_hash[IO_FD_HASH];
+	struct list_head logs;
+	struct list_head streams;
+
+	/* O_DIRECT buffers, mapped on first lease. */
+	char *bufs;
+	size_t bufs_sz;
+	int buf_sz;
+	int bufs_no;
+	char *bufs_leased;
+	int *bufs_free;
+	int bufs_free_sz;
+	struct list_head buf_waiters;
+
+	/* Ring mode, 'ready' holds requests that didn't fit into the
+	 * ring, 'done' the ones in the kernel. */
+	int use_ring;
+	struct uring ring;
+	int ring_inflight;
+	char pipe_buf[64];
+
+	/* Shared with the threads. */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* By class, then by deadline. Holds only the first request of
+	 * an fd, so reordering doesn't break the order for an fd. */
+	struct list_head ready[IO_CLASSES];
+	struct list_head done;
+	int stop;
+	int threads_sz;
+	pthread_t threads[IO_MAX_THREADS];
 };
 
 static int process_callback(int msg_type,
 			    void *msg_payload,
 			    int msg_payload_sz,
 			    void *process_data);
+static void *io_thread_loop(void *data);
+static void ring_arm_pipe(struct io_data *id);
+static void stream_free(struct io_stream *s);
+
+static void io_threads_start(struct io_data *id, int threads)
+{
+	pthread_mutex_init(&id->lock, NULL);
+	pthread_cond_init(&id->cond, NULL);
+
+	/* Signals are read by the signal engine, never by us. */
+	sigset_t all, org;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &org);
+	int i;
+	for (i=0; i < threads; i++) {
+		int r = pthread_create(&id->threads[id->threads_sz], NULL,
+				       &io_thread_loop, id);
+		if (r != 0) {
+			perror("pthread_create()");
+			continue;
+		}
+		id->threads_sz++;
+	}
+	pthread_sigmask(SIG_SETMASK, &org, NULL);
+	if (id->threads_sz == 0) {
+		fatal("Can't start IO threads.");
+	}
+}
+
+static void io_threads_stop(struct io_data *id)
+{
+	pthread_mutex_lock(&id->lock);
+	id->stop = 1;
+	pthread_cond_broadcast(&id->cond);
+	pthread_mutex_unlock(&id->lock);
+
+	int i;
+	for (i=0; i < id->threads_sz; i++) {
+		pthread_join(id->threads[i], NULL);
+	}
+	pthread_mutex_destroy(&id->lock);
+	pthread_cond_destroy(&id->cond);
+}
 
 static void io_constructor(struct base *base,
 			   struct engine_proto *proto,
 			   int user_max_processes)
 {
 	struct io_data *id = type_malloc(struct io_data);
+	id->base = base;
+	int i;
+	for (i=0; i < IO_FD_HASH; i++) {
+		INIT_LIST_HEAD(&id->fd_hash[i]);
+	}
+	for (i=0; i < IO_CLASSES; i++) {
+		INIT_LIST_HEAD(&id->ready[i]);
+	}
+	INIT_LIST_HEAD(&id->done);
+	INIT_LIST_HEAD(&id->logs);
+	INIT_LIST_HEAD(&id->streams);
+	INIT_LIST_HEAD(&id->buf_waiters);
+
+	if (base->options.single_loop) {
+		/* Never blocks, runs the requests inline. */
+		id->pipe_read = -1;
+		id->pipe_write = -1;
+		struct domain *domain = domain_new(base, proto, (void*)-1L, 1);
+		msock_pid_t pid = spawn(domain, process_callback, id, 0);
+		msock_register(domain->base, pid, PID_IO);
+		return;
+	}
 
 	int pipefd[2];
 	if (pipe(pipefd) != 0) {
@@ -28,28 +211,113 @@ static void io_constructor(struct base *base,
 	/* Reading end definetely must block. */
 	set_nonblocking(pipefd[1]);
 	id->pipe_read = pipefd[0];
+	id->pipe_write = pipefd[1];
+
+	if (base->options.io_uring) {
+		if (uring_init(&id->ring, IO_URING_ENTRIES) == 0) {
+			id->use_ring = 1;
+			ring_arm_pipe(id);
+		} else {
+			perror("io_uring_setup(), using threads");
+		}
+	}
+	if (!id->use_ring) {
+		int threads = base->options.io_threads;
+		if (threads <= 0) {
+			threads = IO_DEFAULT_THREADS;
+		}
+		io_threads_start(id, min(threads, IO_MAX_THREADS));
+	}
 
 	struct domain *domain = domain_new(base, proto, (void*)(long)pipefd[1], 1);
 	msock_pid_t pid = spawn(domain, process_callback, id, PROCOPT_HUNGRY);
 	msock_register(domain->base, pid, PID_IO);
 }
 
+static void req_free(struct io_req *req)
+{
+	struct io_req *r, *safe;
+	list_for_each_entry_safe(r, safe, &req->batch, in_fd) {
+		type_free(struct io_req, r);
+	}
+	if (req->log) {
+		msock_safe_free(req->msg.iovcnt * sizeof(struct iovec),
+				(void*)req->msg.iov);
+	}
+	type_free(struct io_req, req);
+}
+
 static void io_data_free(struct io_data *id)
 {
-	close(id->pipe_read);
+	if (id->use_ring) {
+		/* Requests in flight are abandoned. */
+		uring_free(&id->ring);
+		close(id->pipe_read);
+	} else if (id->pipe_read != -1) {
+		io_threads_stop(id);
+		close(id->pipe_read);
+	}
+	struct io_req *req, *safe;
+	list_for_each_entry_safe(req, safe, &id->done, in_pool) {
+		req_free(req);
+	}
+	int i;
+	for (i=0; i < IO_CLASSES; i++) {
+		list_for_each_entry_safe(req, safe, &id->ready[i], in_pool) {
+			req_free(req);
+		}
+	}
+	for (i=0; i < IO_FD_HASH; i++) {
+		struct io_fd *iofd, *fsafe;
+		list_for_each_entry_safe(iofd, fsafe, &id->fd_hash[i], in_hash) {
+			/* First one was in ready or done. */
+			list_del(iofd->reqs.next);
+			list_for_each_entry_safe(req, safe, &iofd->reqs, in_fd) {
+				req_free(req);
+			}
+			type_free(struct io_fd, iofd);
+		}
+	}
+	list_for_each_entry_safe(req, safe, &id->buf_waiters, in_fd) {
+		type_free(struct io_req, req);
+	}
+	if (id->bufs) {
+		munmap(id->bufs, id->bufs_sz);
+		msock_safe_free(id->bufs_no, id->bufs_leased);
+		msock_safe_free(id->bufs_no * sizeof(int), id->bufs_free);
+	}
+	struct io_stream *s, *ssafe;
+	list_for_each_entry_safe(s, ssafe, &id->streams, in_streams) {
+		stream_free(s);
+	}
+	struct io_log *log, *lsafe;
+	list_for_each_entry_safe(log, lsafe, &id->logs, in_logs) {
+		list_for_each_entry_safe(req, safe, &log->pending, in_fd) {
+			type_free(struct io_req, req);
+		}
+		INIT_LIST_HEAD(&log->pending);
+		log->pending_sz = 0;
+		log->flushing = 0;
+		list_del_init(&log->in_logs);
+	}
 	type_free(struct io_data, id);
 }
 
 static void io_destructor(void *ingress_callback_data)
 {
 	int pipe_write = (long)ingress_callback_data;
-	close(pipe_write);
+	if (pipe_write != -1) {
+		close(pipe_write);
+	}
 }
 
 static void io_ingress_callback(void *ingress_callback_data) {
 	int pipe_write = (long)ingress_callback_data;
+	if (pipe_write == -1) {
+		return;
+	}
 	int r = write(pipe_write, "x", 1);
-	if (r == -1) {
+	if (r == -1 && errno != EAGAIN) {
 		perror("write(pipe)");
 	}
 }
@@ -64,25 +332,838 @@ static struct engine_proto engine_io = {
 REGISTER_ENGINE(MSOCK_ENGINE_MASK_IO, &engine_io);
 
 
+static inline int req_expired(struct io_req *req)
+{
+	return req->msg.expires && req->msg.expires <= now_msecs();
+}
 
-struct msock_msg_io {
-	msock_pid_t victim;
-	// open, pread, fsync
-	int fd;
+static void io_run(struct io_req *req)
+{
+	struct msock_msg_io *msg = &req->msg;
+	if (unlikely(req_expired(req))) {
+		req->expired = 1;
+		msg->saved_errno = ETIMEDOUT;
+		msg->ret = -1;
+		msg->count = (uint64_t)-1;
+		if (req->msg_type == MSG_IO_OPEN) {
+			msg->fd = -1;
+		}
+		return;
+	}
+	unsigned long long t0 = now_usecs();
 
-	// pread
-	char *buf;
-	uint64_t count;
-	uint64_t offset;
+	switch (req->msg_type) {
+	case MSG_IO_FSYNC:
+		msg->ret = io_fsync(msg->fd, &msg->saved_errno);
+		break;
+	case MSG_IO_FDATASYNC:
+		msg->ret = io_fdatasync(msg->fd, &msg->saved_errno);
+		break;
+	case MSG_IO_CLOSE:
+		msg->ret = io_close(msg->fd, &msg->saved_errno);
+		break;
+	case MSG_IO_FSTAT:
+		msg->ret = io_fstat(msg->fd, msg->stat, &msg->saved_errno);
+		break;
+	case MSG_IO_PREAD:
+	case MSG_IO_STREAM_CHUNK:
+		msg->count = io_pread(msg->fd,
+				      msg->buf, msg->count, msg->offset,
+				      &msg->saved_errno);
+		break;
+	case MSG_IO_PWRITE:
+		msg->count = io_pwrite(msg->fd,
+				       msg->buf, msg->count, msg->offset,
+				       &msg->saved_errno);
+		break;
+	case MSG_IO_PREADV:
+		msg->count = io_preadv(msg->fd,
+				       msg->iov, msg->iovcnt, msg->offset,
+				       &msg->saved_errno);
+		break;
+	case MSG_IO_PWRITEV:
+		msg->count = io_pwritev(msg->fd,
+					msg->iov, msg->iovcnt, msg->offset,
+					&msg->saved_errno);
+		break;
+	case MSG_IO_SENDFILE:
+		msg->count = io_sendfile(msg->fd, msg->in_fd,
+					 msg->offset, msg->count,
+					 &msg->saved_errno);
+		break;
+	case MSG_IO_OPEN:
+		msg->fd = io_open(msg->pathname, msg->flags, msg->mode,
+				  &msg->saved_errno);
+		break;
+	case MSG_IO_LOG_APPEND:
+		msg->count = io_pwritev(msg->fd,
+					msg->iov, msg->iovcnt, msg->offset,
+					&msg->saved_errno);
+		if (msg->count == req->batch_bytes) {
+			msg->ret = io_fdatasync(msg->fd, &msg->saved_errno);
+		} else {
+			/* Short write means no space left. */
+			if (msg->count != (uint64_t)-1) {
+				msg->saved_errno = ENOSPC;
+			}
+			msg->ret = -1;
+		}
+		break;
+	}
+	req->service_usecs = now_usecs() - t0;
+}
 
-	// open
-	char *pathname;
-	int flags;
-	int mode;
+static inline int class_rank(int io_class)
+{
+	switch (io_class) {
+	case MSOCK_IO_INTERACTIVE:
+		return 0;
+	case MSOCK_IO_BACKGROUND:
+		return 2;
+	default:
+		return 1;
+	}
+}
 
-	int ret;
-	int saved_errno;
-};
+/* No deadline is the farthest one. */
+static inline int expires_before(struct io_req *a, struct io_req *b)
+{
+	return a->msg.expires &&
+		(!b->msg.expires || a->msg.expires < b->msg.expires);
+}
+
+static void ready_add(struct io_data *id, struct io_req *req)
+{
+	struct list_head *head = &id->ready[class_rank(req->msg.io_class)];
+	/* Deadlines are mostly in order, start from the end. */
+	struct list_head *pos = head->prev;
+	while (pos != head &&
+	       expires_before(req, list_entry(pos, struct io_req, in_pool))) {
+		pos = pos->prev;
+	}
+	list_add(&req->in_pool, pos);
+}
+
+static struct io_req *ready_get(struct io_data *id)
+{
+	int i;
+	for (i=0; i < IO_CLASSES; i++) {
+		if (!list_empty(&id->ready[i])) {
+			struct io_req *req = \
+				list_first_entry(&id->ready[i],
+						 struct io_req, in_pool);
+			list_del(&req->in_pool);
+			return req;
+		}
+	}
+	return NULL;
+}
+
+static void *io_thread_loop(void *data)
+{
+	struct io_data *id = (struct io_data *)data;
+
+	pthread_mutex_lock(&id->lock);
+	while (1) {
+		struct io_req *req;
+		while (!id->stop && (req = ready_get(id)) == NULL) {
+			pthread_cond_wait(&id->cond, &id->lock);
+		}
+		if (id->stop) {
+			break;
+		}
+		pthread_mutex_unlock(&id->lock);
+
+		io_run(req);
+
+		pthread_mutex_lock(&id->lock);
+		int was_empty = list_empty(&id->done);
+		list_add_tail(&req->in_pool, &id->done);
+		if (was_empty) {
+			/* Engine drains all of them on wakeup. */
+			int r = write(id->pipe_write, "x", 1);
+			if (r == -1 && errno != EAGAIN) {
+				perror("write(pipe)");
+			}
+		}
+	}
+	pthread_mutex_unlock(&id->lock);
+	return NULL;
+}
+
+/* Wakes the engine up when a message is sent to it. */
+static void ring_arm_pipe(struct io_data *id)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&id->ring);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = id->pipe_read;
+	sqe->addr = (unsigned long)id->pipe_buf;
+	sqe->len = sizeof(id->pipe_buf);
+	sqe->user_data = 0;
+}
+
+/* Sqes are only queued here, they go to the kernel together when the
+ * engine is about to block. */
+static void ring_fill(struct io_data *id)
+{
+	while (id->ring_inflight < IO_URING_ENTRIES - 1) {
+		struct io_req *req = ready_get(id);
+		if (req == NULL) {
+			break;
+		}
+		list_add_tail(&req->in_pool, &id->done);
+		id->ring_inflight++;
+
+		struct msock_msg_io *msg = &req->msg;
+		struct io_uring_sqe *sqe = uring_get_sqe(&id->ring);
+		if (req->stage == 0) {
+			req->submitted_usecs = now_usecs();
+		}
+		switch (req_expired(req) ? 0 : req->msg_type) {
+		case MSG_IO_LOG_APPEND:
+			if (req->stage == 0) {
+				sqe->opcode = IORING_OP_WRITEV;
+				sqe->fd = msg->fd;
+				sqe->addr = (unsigned long)msg->iov;
+				sqe->len = msg->iovcnt;
+				sqe->off = msg->offset;
+			} else {
+				sqe->opcode = IORING_OP_FSYNC;
+				sqe->fd = msg->fd;
+				sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+			}
+			break;
+		case MSG_IO_FDATASYNC:
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+			/* fall through */
+		case MSG_IO_FSYNC:
+			sqe->opcode = IORING_OP_FSYNC;
+			sqe->fd = msg->fd;
+			break;
+		case MSG_IO_CLOSE:
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->fd = msg->fd;
+			break;
+		case MSG_IO_PREAD:
+		case MSG_IO_PWRITE:
+		case MSG_IO_STREAM_CHUNK:
+			sqe->opcode = req->msg_type == MSG_IO_PWRITE ?
+				IORING_OP_WRITE : IORING_OP_READ;
+			sqe->fd = msg->fd;
+			sqe->addr = (unsigned long)msg->buf;
+			sqe->len = msg->count;
+			sqe->off = msg->offset;
+			break;
+		case MSG_IO_PREADV:
+		case MSG_IO_PWRITEV:
+			sqe->opcode = req->msg_type == MSG_IO_PREADV ?
+				IORING_OP_READV : IORING_OP_WRITEV;
+			sqe->fd = msg->fd;
+			sqe->addr = (unsigned long)msg->iov;
+			sqe->len = msg->iovcnt;
+			sqe->off = msg->offset;
+			break;
+		case MSG_IO_OPEN:
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (unsigned long)msg->pathname;
+			sqe->len = msg->mode;
+			sqe->open_flags = msg->flags;
+			break;
+		default:
+			/* Expired, or no io_uring op as for fstat and
+			 * sendfile. Done now, the completion of a nop
+			 * replies. */
+			io_run(req);
+			req->done_inline = 1;
+			sqe->opcode = IORING_OP_NOP;
+			break;
+		}
+		sqe->user_data = (unsigned long)req;
+	}
+}
+
+/* Returns 0 if the request needs another round in the ring. */
+static int ring_complete(struct io_req *req, int res)
+{
+	if (req->done_inline) {
+		return 1;
+	}
+	struct msock_msg_io *msg = &req->msg;
+	if (req->msg_type == MSG_IO_LOG_APPEND && req->stage == 0) {
+		if (res >= 0 && (uint64_t)res == req->batch_bytes) {
+			req->stage = 1;
+			return 0;
+		}
+		res = res < 0 ? res : -ENOSPC;
+	}
+	if (res < 0) {
+		msg->saved_errno = -res;
+		res = -1;
+	}
+	switch (req->msg_type) {
+	case MSG_IO_FSYNC:
+	case MSG_IO_FDATASYNC:
+	case MSG_IO_CLOSE:
+	case MSG_IO_LOG_APPEND:
+		msg->ret = res;
+		break;
+	case MSG_IO_PREAD:
+	case MSG_IO_PWRITE:
+	case MSG_IO_PREADV:
+	case MSG_IO_PWRITEV:
+	case MSG_IO_STREAM_CHUNK:
+		msg->count = (int64_t)res;
+		break;
+	case MSG_IO_OPEN:
+		msg->fd = res;
+		break;
+	}
+	req->service_usecs = now_usecs() - req->submitted_usecs;
+	return 1;
+}
+
+static struct io_fd *iofd_get(struct io_data *id, int fd)
+{
+	struct list_head *bucket = &id->fd_hash[(unsigned)fd % IO_FD_HASH];
+	struct io_fd *iofd;
+	list_for_each_entry(iofd, bucket, in_hash) {
+		if (iofd->fd == fd) {
+			return iofd;
+		}
+	}
+	iofd = type_malloc(struct io_fd);
+	iofd->fd = fd;
+	INIT_LIST_HEAD(&iofd->reqs);
+	list_add(&iofd->in_hash, bucket);
+	return iofd;
+}
+
+static inline struct msock_io_stats *op_stats(struct io_data *id,
+					      int msg_type)
+{
+	return &id->base->io_stats[msg_type - MSG_IO_FSYNC];
+}
+
+static void req_submit(struct io_data *id, struct io_req *req)
+{
+	if (id->use_ring) {
+		ready_add(id, req);
+		ring_fill(id);
+		return;
+	}
+	pthread_mutex_lock(&id->lock);
+	ready_add(id, req);
+	pthread_cond_signal(&id->cond);
+	pthread_mutex_unlock(&id->lock);
+}
+
+/* Fsync does what fdatasync does, not the other way around. A sync
+ * of another class would run at the wrong priority, and one that
+ * expires first could time out while req still had time. */
+static inline int sync_covers(struct io_req *sync, struct io_req *req)
+{
+	if (sync->msg.io_class != req->msg.io_class ||
+	    expires_before(sync, req)) {
+		return 0;
+	}
+	switch (req->msg_type) {
+	case MSG_IO_FSYNC:
+		return sync->msg_type == MSG_IO_FSYNC;
+	case MSG_IO_FDATASYNC:
+		return sync->msg_type == MSG_IO_FSYNC ||
+			sync->msg_type == MSG_IO_FDATASYNC;
+	}
+	return 0;
+}
+
+static void log_batch_done(struct io_data *id, struct io_req *batch);
+static void stream_read_done(struct io_data *id, struct io_req *req);
+
+static void req_done(struct io_data *id, struct io_req *req)
+{
+	if (req->stream) {
+		/* Kept by the stream until it's its turn. */
+		stream_read_done(id, req);
+		return;
+	}
+	if (req->log) {
+		log_batch_done(id, req);
+	} else {
+		struct msock_io_stats *st = op_stats(id, req->msg_type);
+		st->queued--;
+		st->completed++;
+		st->service_usecs += req->service_usecs;
+		st->expired += req->expired;
+
+		msock_send(req->msg.victim, req->msg_type, &req->msg,
+			   sizeof(struct msock_msg_io));
+
+		/* Requeued ones go right after us, before the requests
+		 * that came later. */
+		struct list_head *pos = &req->in_fd;
+		struct io_req *r, *safe;
+		list_for_each_entry_safe(r, safe, &req->batch, in_fd) {
+			list_del(&r->in_fd);
+			if (req->expired && !req_expired(r)) {
+				/* Nothing was synced, r still has time
+				 * for a sync of its own. */
+				struct io_req *prev = \
+					list_entry(pos, struct io_req, in_fd);
+				if (pos != &req->in_fd &&
+				    sync_covers(prev, r)) {
+					list_add_tail(&r->in_fd, &prev->batch);
+				} else {
+					list_add(&r->in_fd, pos);
+					pos = &r->in_fd;
+				}
+				continue;
+			}
+			r->msg.ret = req->msg.ret;
+			r->msg.saved_errno = req->msg.saved_errno;
+			st = op_stats(id, r->msg_type);
+			st->queued--;
+			st->completed++;
+			if (req->expired) {
+				st->expired++;
+			} else {
+				st->coalesced++;
+			}
+			msock_send(r->msg.victim, r->msg_type, &r->msg,
+				   sizeof(struct msock_msg_io));
+			type_free(struct io_req, r);
+		}
+	}
+
+	struct io_fd *iofd = req->iofd;
+	if (iofd) {
+		list_del(&req->in_fd);
+		if (!list_empty(&iofd->reqs)) {
+			req_submit(id, list_first_entry(&iofd->reqs,
+							struct io_req, in_fd));
+		} else {
+			list_del(&iofd->in_hash);
+			type_free(struct io_fd, iofd);
+		}
+	}
+	req_free(req);
+}
+
+static void io_queue(struct io_data *id, struct io_req *req)
+{
+	if (id->pipe_read == -1) {
+		io_run(req);
+		req_done(id, req);
+		return;
+	}
+	if (req->msg_type != MSG_IO_OPEN && req->stream == NULL) {
+		req->iofd = iofd_get(id, req->msg.fd);
+		struct list_head *reqs = &req->iofd->reqs;
+		/* First one may be running already. */
+		if (!list_empty(reqs) && !list_is_singular(reqs)) {
+			struct io_req *last = \
+				list_entry(reqs->prev, struct io_req, in_fd);
+			/* Hasn't started yet, so it syncs all that's
+			 * before us too. */
+			if (sync_covers(last, req)) {
+				list_add_tail(&req->in_fd, &last->batch);
+				return;
+			}
+		}
+		int idle = list_empty(reqs);
+		list_add_tail(&req->in_fd, &req->iofd->reqs);
+		if (!idle) {
+			/* Waits for the previous ones on this fd. */
+			return;
+		}
+	}
+	req_submit(id, req);
+}
+
+static void io_request(struct io_data *id, int msg_type,
+		       struct msock_msg_io *msg)
+{
+	struct io_req *req = type_malloc(struct io_req);
+	req->msg_type = msg_type;
+	memcpy(&req->msg, msg, sizeof(struct msock_msg_io));
+	INIT_LIST_HEAD(&req->batch);
+	op_stats(id, msg_type)->queued++;
+	io_queue(id, req);
+}
+
+/* Everything waiting so far goes into one batch. */
+static void log_flush(struct io_data *id, struct io_log *log)
+{
+	int n = min(log->pending_sz, IO_LOG_BATCH);
+	struct iovec *iov = \
+		(struct iovec*)msock_safe_malloc(n * sizeof(struct iovec));
+
+	struct io_req *batch = type_malloc(struct io_req);
+	batch->msg_type = MSG_IO_LOG_APPEND;
+	batch->log = log;
+	INIT_LIST_HEAD(&batch->batch);
+
+	int i;
+	for (i=0; i < n; i++) {
+		struct io_req *req = \
+			list_first_entry(&log->pending, struct io_req, in_fd);
+		list_del(&req->in_fd);
+		list_add_tail(&req->in_fd, &batch->batch);
+		iov[i].iov_base = req->msg.buf;
+		iov[i].iov_len = req->msg.count;
+		req->msg.offset = log->size + batch->batch_bytes;
+		batch->batch_bytes += req->msg.count;
+	}
+	log->pending_sz -= n;
+	log->flushing = 1;
+
+	batch->msg.fd = log->fd;
+	batch->msg.iov = iov;
+	batch->msg.iovcnt = n;
+	batch->msg.offset = log->size;
+	log->size += batch->batch_bytes;
+	io_queue(id, batch);
+}
+
+static void logs_flush(struct io_data *id)
+{
+	struct io_log *log;
+	list_for_each_entry(log, &id->logs, in_logs) {
+		if (!log->flushing && log->pending_sz) {
+			log_flush(id, log);
+		}
+	}
+}
+
+static void log_batch_done(struct io_data *id, struct io_req *batch)
+{
+	struct io_log *log = batch->log;
+	struct msock_io_stats *st = op_stats(id, MSG_IO_LOG_APPEND);
+
+	struct io_req *req, *safe;
+	list_for_each_entry_safe(req, safe, &batch->batch, in_fd) {
+		req->msg.ret = batch->msg.ret;
+		req->msg.saved_errno = batch->msg.saved_errno;
+		st->queued--;
+		st->completed++;
+		st->service_usecs += batch->service_usecs;
+		msock_send(req->msg.victim, MSG_IO_LOG_APPEND, &req->msg,
+			   sizeof(struct msock_msg_io));
+		list_del(&req->in_fd);
+		type_free(struct io_req, req);
+	}
+	if (batch->msg.ret != 0) {
+		/* Nothing of it is acknowledged, next one overwrites. */
+		log->size = batch->msg.offset;
+	}
+	log->flushing = 0;
+	/* Appends that came in the meantime. */
+	if (log->pending_sz) {
+		log_flush(id, log);
+	}
+}
+
+static void log_append(struct io_data *id, struct msock_msg_io *msg)
+{
+	struct io_log *log = (struct io_log*)msg->log;
+	struct io_req *req = type_malloc(struct io_req);
+	req->msg_type = MSG_IO_LOG_APPEND;
+	memcpy(&req->msg, msg, sizeof(struct msock_msg_io));
+	op_stats(id, MSG_IO_LOG_APPEND)->queued++;
+
+	if (list_empty(&log->in_logs)) {
+		list_add_tail(&log->in_logs, &id->logs);
+	}
+	INIT_LIST_HEAD(&req->batch);
+	list_add_tail(&req->in_fd, &log->pending);
+	log->pending_sz++;
+
+	if (id->pipe_read == -1 && !log->flushing) {
+		/* Nothing to wait for when run inline. */
+		log_flush(id, log);
+	}
+}
+
+static void io_collect(struct io_data *id)
+{
+	struct list_head done;
+	INIT_LIST_HEAD(&done);
+	pthread_mutex_lock(&id->lock);
+	list_splice_init(&id->done, &done);
+	pthread_mutex_unlock(&id->lock);
+
+	struct io_req *req, *safe;
+	list_for_each_entry_safe(req, safe, &done, in_pool) {
+		req_done(id, req);
+	}
+}
+
+static void stream_free(struct io_stream *s)
+{
+	struct io_req *req, *safe;
+	list_for_each_entry_safe(req, safe, &s->done, in_pool) {
+		type_free(struct io_req, req);
+	}
+	int i;
+	for (i=0; i < s->depth; i++) {
+		free(s->bufs[i]);
+	}
+	msock_safe_free(s->depth * sizeof(char*), s->bufs);
+	msock_safe_free(s->depth * sizeof(char*), s->bufs_free);
+	list_del(&s->in_streams);
+	type_free(struct io_stream, s);
+}
+
+static void stream_fill(struct io_data *id, struct io_stream *s)
+{
+	while (!s->ended && !s->closed && s->bufs_free_sz) {
+		struct io_req *req = type_malloc(struct io_req);
+		req->msg_type = MSG_IO_STREAM_CHUNK;
+		INIT_LIST_HEAD(&req->batch);
+		req->stream = s;
+		req->seq = s->next_seq++;
+		req->msg.victim = s->victim;
+		req->msg.stream = s;
+		req->msg.fd = s->fd;
+		req->msg.buf = s->bufs_free[--s->bufs_free_sz];
+		req->msg.count = s->chunk_sz;
+		req->msg.offset = s->offset;
+		s->offset += s->chunk_sz;
+		s->inflight++;
+		op_stats(id, MSG_IO_STREAM_CHUNK)->queued++;
+		io_queue(id, req);
+	}
+}
+
+/* A closed stream stays until no read is in flight and every buffer
+ * handed out is back, chunks sent before the close still have them. */
+static void stream_maybe_free(struct io_stream *s)
+{
+	if (s->closed && s->inflight == 0 && s->bufs_free_sz == s->depth) {
+		stream_free(s);
+	}
+}
+
+static void stream_send(struct io_stream *s, struct io_req *req)
+{
+	msock_send(s->victim, MSG_IO_STREAM_CHUNK, &req->msg,
+		   sizeof(struct msock_msg_io));
+}
+
+static void stream_read_done(struct io_data *id, struct io_req *req)
+{
+	struct io_stream *s = req->stream;
+	struct msock_io_stats *st = op_stats(id, MSG_IO_STREAM_CHUNK);
+	st->queued--;
+	st->completed++;
+	st->service_usecs += req->service_usecs;
+	s->inflight--;
+
+	/* Threads can finish out of order, usually it's the last one. */
+	struct list_head *pos = s->done.prev;
+	while (pos != &s->done &&
+	       list_entry(pos, struct io_req, in_pool)->seq > req->seq) {
+		pos = pos->prev;
+	}
+	list_add(&req->in_pool, pos);
+
+	while (!list_empty(&s->done)) {
+		req = list_first_entry(&s->done, struct io_req, in_pool);
+		if (req->seq != s->deliver_seq && !s->ended) {
+			break;
+		}
+		list_del(&req->in_pool);
+		s->deliver_seq++;
+
+		uint64_t count = req->msg.count;
+		if (s->ended || s->closed ||
+		    count == 0 || count == (uint64_t)-1) {
+			/* Buffer isn't passed on. */
+			s->bufs_free[s->bufs_free_sz++] = req->msg.buf;
+			if (!s->ended && !s->closed) {
+				req->msg.buf = NULL;
+				stream_send(s, req);
+			}
+			s->ended = 1;
+		} else {
+			stream_send(s, req);
+			if (count < (uint64_t)s->chunk_sz) {
+				/* Short read, the file ends here. */
+				s->ended = 1;
+				req->msg.buf = NULL;
+				req->msg.offset += count;
+				req->msg.count = 0;
+				stream_send(s, req);
+			}
+		}
+		type_free(struct io_req, req);
+	}
+
+	stream_fill(id, s);
+	stream_maybe_free(s);
+}
+
+static void stream_open(struct io_data *id, struct msock_msg_io *msg)
+{
+	struct io_stream *s = (struct io_stream*)msg->stream;
+	s->bufs = (char**)msock_safe_malloc(s->depth * sizeof(char*));
+	s->bufs_free = (char**)msock_safe_malloc(s->depth * sizeof(char*));
+	int i;
+	for (i=0; i < s->depth; i++) {
+		/* Aligned for O_DIRECT. */
+		if (posix_memalign((void**)&s->bufs[i], IO_BUFFER_ALIGN,
+				   s->chunk_sz) != 0) {
+			pfatal("posix_memalign()");
+		}
+		s->bufs_free[i] = s->bufs[i];
+	}
+	s->bufs_free_sz = s->depth;
+	list_add(&s->in_streams, &id->streams);
+
+	posix_fadvise(s->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	stream_fill(id, s);
+}
+
+static void stream_done(struct io_data *id, struct msock_msg_io *msg)
+{
+	struct io_stream *s = (struct io_stream*)msg->stream;
+	if (msg->buf == NULL) {
+		/* Last chunk, it has no buffer. */
+		return;
+	}
+	s->bufs_free[s->bufs_free_sz++] = msg->buf;
+	stream_fill(id, s);
+	stream_maybe_free(s);
+}
+
+static void stream_close(struct io_data *id, struct msock_msg_io *msg)
+{
+	struct io_stream *s = (struct io_stream*)msg->stream;
+	s->closed = 1;
+	stream_maybe_free(s);
+}
+
+static void bufs_map(struct io_data *id)
+{
+	struct msock_options *options = &id->base->options;
+	id->bufs_no = options->io_buffers > 0 ?
+		options->io_buffers : IO_DEFAULT_BUFFERS;
+	id->buf_sz = options->io_buffer_sz > 0 ?
+		options->io_buffer_sz : IO_DEFAULT_BUFFER_SZ;
+	id->buf_sz = (id->buf_sz + IO_BUFFER_ALIGN - 1) & ~(IO_BUFFER_ALIGN - 1);
+	id->bufs_sz = (size_t)id->bufs_no * id->buf_sz;
+
+	void *ptr = MAP_FAILED;
+	if (options->io_buffers_huge) {
+		size_t sz = (id->bufs_sz + HUGE_PAGE_SZ - 1) & ~(HUGE_PAGE_SZ - 1);
+		ptr = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (ptr != MAP_FAILED) {
+			id->bufs_sz = sz;
+		}
+	}
+	if (ptr == MAP_FAILED) {
+		ptr = mmap(NULL, id->bufs_sz, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ptr == MAP_FAILED) {
+			pfatal("mmap()");
+		}
+		if (options->io_buffers_huge) {
+			/* No reserved huge pages, transparent ones then. */
+			madvise(ptr, id->bufs_sz, MADV_HUGEPAGE);
+		}
+	}
+	id->bufs = (char*)ptr;
+	id->bufs_leased = (char*)msock_safe_malloc(id->bufs_no);
+	id->bufs_free = (int*)msock_safe_malloc(id->bufs_no * sizeof(int));
+	int i;
+	/* Lowest addresses first. */
+	for (i=0; i < id->bufs_no; i++) {
+		id->bufs_free[i] = id->bufs_no - 1 - i;
+	}
+	id->bufs_free_sz = id->bufs_no;
+}
+
+static void buf_reply(struct io_data *id, struct io_req *req)
+{
+	int idx = id->bufs_free[--id->bufs_free_sz];
+	id->bufs_leased[idx] = 1;
+	req->msg.buf = id->bufs + (size_t)idx * id->buf_sz;
+	req->msg.count = id->buf_sz;
+
+	struct msock_io_stats *st = op_stats(id, MSG_IO_BUF_LEASE);
+	st->queued--;
+	st->completed++;
+	msock_send(req->msg.victim, MSG_IO_BUF_LEASE, &req->msg,
+		   sizeof(struct msock_msg_io));
+	type_free(struct io_req, req);
+}
+
+static void buf_lease(struct io_data *id, struct msock_msg_io *msg)
+{
+	if (unlikely(id->bufs == NULL)) {
+		bufs_map(id);
+	}
+	struct io_req *req = type_malloc(struct io_req);
+	req->msg_type = MSG_IO_BUF_LEASE;
+	memcpy(&req->msg, msg, sizeof(struct msock_msg_io));
+	op_stats(id, MSG_IO_BUF_LEASE)->queued++;
+
+	if (id->bufs_free_sz) {
+		buf_reply(id, req);
+	} else {
+		list_add_tail(&req->in_fd, &id->buf_waiters);
+	}
+}
+
+static void buf_release(struct io_data *id, struct msock_msg_io *msg)
+{
+	char *buf = msg->buf;
+	if (unlikely(buf < id->bufs || buf >= id->bufs + id->bufs_sz ||
+		     (buf - id->bufs) % id->buf_sz)) {
+		fatal("Not an IO buffer %p", buf);
+	}
+	int idx = (buf - id->bufs) / id->buf_sz;
+	if (unlikely(!id->bufs_leased[idx])) {
+		fatal("IO buffer %p released twice", buf);
+	}
+	id->bufs_leased[idx] = 0;
+	id->bufs_free[id->bufs_free_sz++] = idx;
+	op_stats(id, MSG_IO_BUF_RELEASE)->completed++;
+
+	if (!list_empty(&id->buf_waiters)) {
+		struct io_req *req = \
+			list_first_entry(&id->buf_waiters, struct io_req, in_fd);
+		list_del(&req->in_fd);
+		buf_reply(id, req);
+	}
+}
+
+static void ring_wait(struct io_data *id)
+{
+	if (uring_submit_and_wait(&id->ring, 1, -1) == -1) {
+		pfatal("io_uring_enter()");
+	}
+	struct io_uring_cqe *cqe;
+	while ((cqe = uring_peek_cqe(&id->ring)) != NULL) {
+		struct io_req *req = (struct io_req*)(unsigned long)cqe->user_data;
+		int res = cqe->res;
+		uring_cqe_seen(&id->ring);
+
+		if (req == NULL) {
+			ring_arm_pipe(id);
+			continue;
+		}
+		list_del(&req->in_pool);
+		id->ring_inflight--;
+		if (!ring_complete(req, res)) {
+			ready_add(id, req);
+			continue;
+		}
+		req_done(id, req);
+	}
+	ring_fill(id);
+}
 
 static int process_callback(int msg_type,
 			    void *msg_payload,
@@ -92,23 +1173,36 @@ static int process_callback(int msg_type,
 	struct io_data *id = (struct io_data*)process_data;
 	struct msock_msg_io *msg = (struct msock_msg_io *)msg_payload;
 
-
-	struct msock_msg_io out;
-	memcpy(&out, msg, sizeof(out));
-
-	errno = 0;
 	switch (msg_type) {
 	case MSG_IO_FSYNC:
-		out.ret = io_fsync(msg->fd, &out.saved_errno);
-		break;
+	case MSG_IO_OPEN:
 	case MSG_IO_PREAD:
-		out.count = io_pread(msg->fd,
-				     out.buf, msg->count, msg->offset,
-				     &out.saved_errno);
+	case MSG_IO_PWRITE:
+	case MSG_IO_PREADV:
+	case MSG_IO_PWRITEV:
+	case MSG_IO_FDATASYNC:
+	case MSG_IO_CLOSE:
+	case MSG_IO_FSTAT:
+	case MSG_IO_SENDFILE:
+		io_request(id, msg_type, msg);
 		break;
-	case MSG_IO_OPEN:
-		out.fd = io_open(msg->pathname, msg->flags, msg->mode,
-				 &out.saved_errno);
+	case MSG_IO_LOG_APPEND:
+		log_append(id, msg);
+		break;
+	case MSG_IO_BUF_LEASE:
+		buf_lease(id, msg);
+		break;
+	case MSG_IO_BUF_RELEASE:
+		buf_release(id, msg);
+		break;
+	case MSG_IO_STREAM_OPEN:
+		stream_open(id, msg);
+		break;
+	case MSG_IO_STREAM_DONE:
+		stream_done(id, msg);
+		break;
+	case MSG_IO_STREAM_CLOSE:
+		stream_close(id, msg);
 		break;
 
 	case MSG_EXIT:
@@ -116,26 +1210,51 @@ static int process_callback(int msg_type,
 		return RECV_EXIT;
 
 	case MSG_QUEUE_EMPTY: {
-		//safe_printf("block start io\n");
+		/* Appends of this run are grouped, before we sleep. */
+		logs_flush(id);
+		if (id->use_ring) {
+			ring_wait(id);
+			return RECV_OK;
+		}
 		char buf[256];
 		read(id->pipe_read, buf, sizeof(buf));
-		//safe_printf("block done io\n");
+		io_collect(id);
 		return RECV_OK;}
 	default:
-		fatal("?");
+		fatal("Broken message %#x", msg_type);
 	}
-	msock_send(msg->victim, msg_type, &out, sizeof(out));
 	return RECV_OK;
 }
 
+DLL_PUBLIC void msock_io_stats(int msg_type, struct msock_io_stats *stats)
+{
+	struct base *base = get_current_process()->domain->base;
+	if (msg_type < MSG_IO_FSYNC || msg_type - MSG_IO_FSYNC >= IO_OPS) {
+		fatal("Not an IO message %#x", msg_type);
+	}
+	*stats = base->io_stats[msg_type - MSG_IO_FSYNC];
+}
+
 
 static void msg_io_send_helper(int msg_type, struct msock_msg_io *msg)
 {
+	struct process *process = get_current_process();
+	msg->io_class = process->io_class;
+	if (process->io_timeout_msecs) {
+		msg->expires = now_msecs() + process->io_timeout_msecs;
+	}
 	msock_send(PID_IO,
 		   msg_type,
 		   msg, sizeof(struct msock_msg_io));
 }
 
+DLL_PUBLIC void msock_io_set_class(int io_class, unsigned long timeout_msecs)
+{
+	struct process *process = get_current_process();
+	process->io_class = io_class;
+	process->io_timeout_msecs = timeout_msecs;
+}
+
 DLL_PUBLIC void msock_io_fsync(int fd)
 {
 	struct msock_msg_io msg;
@@ -146,6 +1265,37 @@ DLL_PUBLIC void msock_io_fsync(int fd)
 	msg_io_send_helper(MSG_IO_FSYNC, &msg);
 }
 
+DLL_PUBLIC void msock_io_fdatasync(int fd)
+{
+	struct msock_msg_io msg;
+	memset(&msg, 0, sizeof(msg));
+
+	msg.victim = msock_self();
+	msg.fd = fd;
+	msg_io_send_helper(MSG_IO_FDATASYNC, &msg);
+}
+
+DLL_PUBLIC void msock_io_close(int fd)
+{
+	struct msock_msg_io msg;
+	memset(&msg, 0, sizeof(msg));
+
+	msg.victim = msock_self();
+	msg.fd = fd;
+	msg_io_send_helper(MSG_IO_CLOSE, &msg);
+}
+
+DLL_PUBLIC void msock_io_fstat(int fd, struct stat *buf)
+{
+	struct msock_msg_io msg;
+	memset(&msg, 0, sizeof(msg));
+
+	msg.victim = msock_self();
+	msg.fd = fd;
+	msg.stat = buf;
+	msg_io_send_helper(MSG_IO_FSTAT, &msg);
+}
+
 DLL_PUBLIC void msock_io_open(char *pathname, int flags, int mode)
 {
 	struct msock_msg_io msg;
@@ -170,3 +1320,156 @@ DLL_PUBLIC void msock_io_pread(int fd, char *buf, uint64_t count, uint64_t offse
 	msg.offset = offset;
 	msg_io_send_helper(MSG_IO_PREAD, &msg);
 }
+
+DLL_PUBLIC void msock_io_pwrite(int fd, const char *buf, uint64_t count,
+				uint64_t offset)
+{
+	struct msock_msg_io msg;
+	memset(&msg, 0, sizeof(msg));
+
+	msg.victim = msock_self();
+	msg.fd = fd;
+	msg.buf = (char*)buf;
+	msg.count = count;
+	msg.offset = offset;
+	msg_io_send_helper(MSG_IO_PWRITE, &msg);
+}
+
+DLL_PUBLIC void msock_io_preadv(int fd, const struct iovec *iov, int iovcnt,
+				uint64_t offset)
+{
+	struct msock_msg_io msg;
+	memset(&msg, 0, sizeof(msg));
+
+	msg.victim = msock_self();
+	msg.fd = fd;
+	msg.iov = iov;
+	msg.iovcnt = iovcnt;
+	msg.offset = offset;
+	msg_io_send_helper(MSG_IO_PREADV, &msg);
+}
+
+DLL_PUBLIC void msock_io_pwritev(int fd, const struct iovec *iov, int iovcnt,
+				 uint64_t offset)
+{
+	struct msock_msg_io msg;
+	memset(&msg, 0, sizeof(msg));
+
+	msg.victim = msock_self();
+	msg.fd = fd;
+	msg.iov = iov;
+	msg.iovcnt = iovcnt;
+	msg.offset = offset;
+	msg_io_send_helper(MSG_IO_PWRITEV, &msg);
+}
+
+DLL_PUBLIC void msock_io_sendfile(int out_fd, int in_fd, uint64_t offset,
+				  uint64_t count)
+{
+	struct msock_msg_io msg;
+	memset(&msg, 0, sizeof(msg));
+
+	msg.victim = msock_self();
+	msg.fd = out_fd;
+	msg.in_fd = in_fd;
+	msg.offset = offset;
+	msg.count = count;
+	msg_io_send_helper(MSG_IO_SENDFILE, &msg);
+}
+
+DLL_PUBLIC void msock_io_buf_lease()
+{
+	struct msock_msg_io msg;
+	memset(&msg, 0, sizeof(msg));
+
+	msg.victim = msock_self();
+	msg_io_send_helper(MSG_IO_BUF_LEASE, &msg);
+}
+
+DLL_PUBLIC void msock_io_buf_release(char *buf)
+{
+	struct msock_msg_io msg;
+	memset(&msg, 0, sizeof(msg));
+
+	msg.victim = msock_self();
+	msg.buf = buf;
+	msg_io_send_helper(MSG_IO_BUF_RELEASE, &msg);
+}
+
+DLL_PUBLIC msock_stream msock_io_stream_open(int fd, int chunk_sz, int depth)
+{
+	struct io_stream *s = type_malloc(struct io_stream);
+	s->victim = msock_self();
+	s->fd = fd;
+	s->chunk_sz = chunk_sz;
+	s->depth = max(depth, 1);
+	INIT_LIST_HEAD(&s->done);
+
+	struct msock_msg_io msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.victim = msock_self();
+	msg.stream = s;
+	msg_io_send_helper(MSG_IO_STREAM_OPEN, &msg);
+	return s;
+}
+
+DLL_PUBLIC void msock_io_stream_done(msock_stream stream, char *buf)
+{
+	struct msock_msg_io msg;
+	memset(&msg, 0, sizeof(msg));
+
+	msg.victim = msock_self();
+	msg.stream = stream;
+	msg.buf = buf;
+	msg_io_send_helper(MSG_IO_STREAM_DONE, &msg);
+}
+
+DLL_PUBLIC void msock_io_stream_close(msock_stream stream)
+{
+	struct msock_msg_io msg;
+	memset(&msg, 0, sizeof(msg));
+
+	msg.victim = msock_self();
+	msg.stream = stream;
+	msg_io_send_helper(MSG_IO_STREAM_CLOSE, &msg);
+}
+
+DLL_PUBLIC msock_log msock_log_open(const char *pathname)
+{
+	int fd = open(pathname, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		return NULL;
+	}
+	off_t size = lseek(fd, 0, SEEK_END);
+	if (size == -1) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return NULL;
+	}
+	struct io_log *log = type_malloc(struct io_log);
+	INIT_LIST_HEAD(&log->in_logs);
+	INIT_LIST_HEAD(&log->pending);
+	log->fd = fd;
+	log->size = size;
+	return log;
+}
+
+DLL_PUBLIC void msock_log_close(msock_log ulog)
+{
+	struct io_log *log = (struct io_log*)ulog;
+	close(log->fd);
+	type_free(struct io_log, log);
+}
+
+DLL_PUBLIC void msock_log_append(msock_log log, const char *buf, uint64_t len)
+{
+	struct msock_msg_io msg;
+	memset(&msg, 0, sizeof(msg));
+
+	msg.victim = msock_self();
+	msg.log = log;
+	msg.buf = (char*)buf;
+	msg.count = len;
+	msg_io_send_helper(MSG_IO_LOG_APPEND, &msg);
+}
@@ -12,27 +12,29 @@
  * everything by default. With the exception of obvious ones like SIGSEGV.
  *
  * For example by default Ctrl+C will be swallowed.
+ *
+ * Same goes for signalfd(2), which we read the signals from.
  */
 
 #include <unistd.h>
 #include <signal.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/signalfd.h>
 
 #include "msock_internal.h"
 
-#define MAX_SIGNALS (SIGUNUSED+1)
+#define MAX_SIGNALS (_NSIG)
+
+/* Signals are read from a signalfd, subscribed in the select engine.
+ * The process isn't hungry, so the engine doesn't need a thread. */
 
 struct remote_data {
 	sigset_t org_blocked;	/* Blocked before entering our code. */
-	int pipe_write;
 };
 
 struct local_data {
-	int pipe_read;
-	sigset_t blocked;	/* Blocked for all the threads. */
-	sigset_t handled;	/* Handled by us any more. */
-	sigset_t prev_handled;
+	int sfd;
+	sigset_t handled;	/* Signals read from the signalfd. */
 	msock_pid_t victims[MAX_SIGNALS];
 };
 
@@ -41,29 +43,6 @@ static int process_callback(int msg_type,
 			    int msg_payload_sz,
 			    void *process_data);
 
-static __thread struct local_data *handler_sd;
-static void signal_handler(int signum, siginfo_t *si, void *ucontext)
-{
-	if (unlikely(handler_sd == NULL)) {
-		fatal("Signal %i not handled correctly!", signum);
-	}
-	if (handler_sd->victims[signum] ) {
-		struct msock_msg_signal msg;
-
-		msg.signum = signum;
-		msg.victim = NULL;
-		msg.siginfo = *si;
-		msock_send(handler_sd->victims[signum],
-			   MSG_SIGNAL,
-			   (void*)&msg, sizeof(msg));
-
-		handler_sd->victims[signum] = NULL;
-		sigdelset(&handler_sd->handled, signum);
-	} else {
-		// Signal is not handled by anyone - just ignore it.
-	}
-}
-
 
 static void engine_constructor(struct base *base,
 			       struct engine_proto *proto,
@@ -71,70 +50,46 @@ static void engine_constructor(struct base *base,
 {
 	struct local_data *sd = type_malloc(struct local_data);
 	sigset_t org_blocked;
-
-	int pipefd[2];
-	if (pipe(pipefd) != 0) {
-		pfatal("pipe()");
-	}
-	set_nonblocking(pipefd[0]);
-	set_nonblocking(pipefd[1]);
-
-	sd->pipe_read = pipefd[0];
+	sigset_t blocked;
 
 	sigemptyset(&org_blocked);
 	sigemptyset(&sd->handled);
-	sigemptyset(&sd->prev_handled);
 
 	// Beware if we're not in the threaded environment
-	sigfillset(&sd->blocked);
+	sigfillset(&blocked);
 	// there's no point in blocking following signals
-	sigdelset(&sd->blocked, SIGKILL);
-	sigdelset(&sd->blocked, SIGSTOP);
-	sigdelset(&sd->blocked, SIGBUS);
-	sigdelset(&sd->blocked, SIGFPE);
-	sigdelset(&sd->blocked, SIGILL);
-	sigdelset(&sd->blocked, SIGSEGV);
-	sigdelset(&sd->blocked, SIGABRT);
-	sigdelset(&sd->blocked, 64); /* SIGRT32 is used by valgrind. */
-
-	int r = sigprocmask(SIG_BLOCK, &sd->blocked, &org_blocked);
+	sigdelset(&blocked, SIGKILL);
+	sigdelset(&blocked, SIGSTOP);
+	sigdelset(&blocked, SIGBUS);
+	sigdelset(&blocked, SIGFPE);
+	sigdelset(&blocked, SIGILL);
+	sigdelset(&blocked, SIGSEGV);
+	sigdelset(&blocked, SIGABRT);
+	sigdelset(&blocked, 64); /* SIGRT32 is used by valgrind. */
+
+	int r = sigprocmask(SIG_BLOCK, &blocked, &org_blocked);
 	if (r != 0) {
 		fatal("sigprocmask(SIG_BLOCK, *)");
 	}
 
-	/* Restore default handlers. */
-	/* int i; */
-	/* for (i=1; i < MAX_SIGNALS; i++) { */
-	/* 	if (sigismember(&sd->blocked, i)) { */
-	/* 		struct sigaction sa; */
-	/* 		memset(&sa, 0, sizeof(sa)); */
-	/* 		sa.sa_handler = SIG_DFL; */
-	/* 		sigaction(i, &sa, NULL); */
-	/* 	} */
-	/* } */
+	sd->sfd = signalfd(-1, &sd->handled, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sd->sfd == -1) {
+		pfatal("signalfd()");
+	}
 
 	struct remote_data *rd = type_malloc(struct remote_data);
-	rd->pipe_write = pipefd[1];
 	rd->org_blocked = org_blocked;
 
 	struct domain *domain = domain_new(base, proto, rd, 1);
-	msock_pid_t pid = spawn(domain, process_callback, sd, PROCOPT_HUNGRY);
+	msock_pid_t pid = spawn(domain, process_callback, sd, 0);
 	msock_register(domain->base, pid, PID_SIGNAL);
+	msock_base_send_msg_fd(base, pid, MSG_FD_SUBSCRIBE, sd->sfd, 0);
 	return;
 }
 
 static void engine_data_free(struct local_data *sd)
 {
-	close(sd->pipe_read);
-	int i;
-	for (i=1; i < MAX_SIGNALS; i++) {
-		if (sigismember(&sd->handled, i)) {
-			struct sigaction sa;
-			memset(&sa, 0, sizeof(sa));
-			sa.sa_handler = SIG_DFL;
-			sigaction(i, &sa, NULL);
-		}
-	}
+	close(sd->sfd);
 	type_free(struct local_data, sd);
 }
 
@@ -147,80 +102,83 @@ static void engine_destructor(void *ingress_callback_data)
 		fatal("sigprocmask(SIG_SETMASK, old_mask)");
 	}
 
-	close(rd->pipe_write);
-
 	type_free(struct remote_data, rd);
 }
 
 static void engine_ingress_callback(void *ingress_callback_data)
 {
-	struct remote_data *rd = (struct remote_data*)ingress_callback_data;
-	int r = write(rd->pipe_write, "x", 1);
-	if (r == -1) {
-		perror("write(pipe)");
-	}
+	return;
 }
 
-static struct engine_proto engine_user = {
-	.name = NULL,
+static struct engine_proto engine_signal = {
+	.name = "signal",
 	.constructor = engine_constructor,
 	.destructor = engine_destructor,
 	.ingress_callback = engine_ingress_callback
 };
 
 
-REGISTER_ENGINE(MSOCK_ENGINE_MASK_SIGNAL, &engine_user);
+REGISTER_ENGINE(MSOCK_ENGINE_MASK_SIGNAL, &engine_signal);
 
 
-static void process_block(struct local_data *sd)
+static void update_mask(struct local_data *sd)
 {
-	/* Set proper signal handlers. */
-	int i;
-	for (i=1; i < MAX_SIGNALS; i++) {
-		struct sigaction sa;
-		int in_prev_handled = sigismember(&sd->prev_handled, i);
-		int in_handled = sigismember(&sd->handled, i);
-		if (!in_prev_handled && in_handled) { // add our handler
-			memset(&sa, 0, sizeof(sa));
-			sa.sa_sigaction = &signal_handler;
-			sa.sa_mask = sd->blocked; // serialize all signals
-			sa.sa_flags = SA_SIGINFO;
-			sigaction(i, &sa, NULL);
-		}
-		if (in_prev_handled && !in_handled) { // go back do default
-			memset(&sa, 0, sizeof(sa));
-			sa.sa_handler = SIG_DFL;
-			sigaction(i, &sa, NULL);
-		}
+	if (signalfd(sd->sfd, &sd->handled, 0) == -1) {
+		pfatal("signalfd()");
 	}
-	sd->prev_handled = sd->handled;
-
-
-	sigset_t nothandled;
-	sigemptyset(&nothandled);
-
-	fd_set readfds;
-
-	FD_ZERO(&readfds);
-	FD_SET(sd->pipe_read, &readfds);
-	errno = 0;
+}
 
-	handler_sd = sd;
-	int r = pselect(sd->pipe_read+1,
-			&readfds, NULL, NULL,
-			NULL, &nothandled);
-	handler_sd = NULL;
+static void siginfo_from_fdsi(siginfo_t *si, struct signalfd_siginfo *fdsi)
+{
+	memset(si, 0, sizeof(siginfo_t));
+	si->si_signo = fdsi->ssi_signo;
+	si->si_errno = fdsi->ssi_errno;
+	si->si_code = fdsi->ssi_code;
+	si->si_pid = fdsi->ssi_pid;
+	si->si_uid = fdsi->ssi_uid;
+	si->si_status = fdsi->ssi_status;
+	si->si_value.sival_ptr = (void*)(unsigned long)fdsi->ssi_ptr;
+}
 
-	if (r == -1) {
-		if (errno != EINTR) {
-			pfatal("pselect()");
+/* Edge triggered, read until EAGAIN. */
+static void read_signals(struct local_data *sd)
+{
+	struct signalfd_siginfo fdsi[16];
+	int changed = 0;
+	while (1) {
+		int r = read(sd->sfd, fdsi, sizeof(fdsi));
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN) {
+				pfatal("read(signalfd)");
+			}
+			break;
+		}
+		int i;
+		for (i=0; i < r / sizeof(struct signalfd_siginfo); i++) {
+			int signum = fdsi[i].ssi_signo;
+			if (signum >= MAX_SIGNALS || !sd->victims[signum]) {
+				// Signal is not handled by anyone - just ignore it.
+				continue;
+			}
+			struct msock_msg_signal msg;
+			msg.signum = signum;
+			msg.victim = NULL;
+			siginfo_from_fdsi(&msg.siginfo, &fdsi[i]);
+			msock_send(sd->victims[signum],
+				   MSG_SIGNAL,
+				   (void*)&msg, sizeof(msg));
+
+			/* One shot, register again to get next one. */
+			sd->victims[signum] = NULL;
+			sigdelset(&sd->handled, signum);
+			changed = 1;
 		}
-		// break on signal - to flush message buffer
-	} else if (r == 0) {
-		// timeout
-	} else {
-		char buf[32];
-		read(sd->pipe_read, buf, sizeof(buf));
+	}
+	if (changed) {
+		update_mask(sd);
 	}
 }
 
@@ -236,19 +194,28 @@ static int process_callback(int msg_type,
 	case MSG_SIGNAL_REGISTER:
 		sd->victims[msg->signum] = msg->victim;
 		sigaddset(&sd->handled, msg->signum);
+		update_mask(sd);
+		/* A signal pending since before doesn't make a new edge. */
+		read_signals(sd);
 		break;
 	case MSG_SIGNAL_UNREGISTER:
 		sd->victims[msg->signum] = NULL;
 		sigdelset(&sd->handled, msg->signum);
+		update_mask(sd);
+		break;
+
+	case MSG_FD_READ:
+	case MSG_FD_CLOSE:
+		/* Reading tells if the signalfd is really broken. */
+		read_signals(sd);
+		break;
+	case MSG_FD_WRITE:
 		break;
 
 	case MSG_EXIT:
 		engine_data_free(sd);
 		return RECV_EXIT;
 
-	case MSG_QUEUE_EMPTY:
-		process_block(sd);
-		return RECV_OK;
 	default:
 		fatal("Broken message %#x", msg_type);
 	}
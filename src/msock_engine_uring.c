@@ -0,0 +1,575 @@
+/* Select engine on top of io_uring poll requests. Replaces
+ * msock_engine_epoll, see USE_URING in the Makefile. */
+
+#include <poll.h>
+#include <unistd.h>
+
+#include "timer.h"
+#include "msock_internal.h"
+#include "uring.h"
+
+
+struct local_data;
+
+#define URING_ENTRIES (1024)
+
+/* Items are allocated lazily, in chunks, on first use of an fd. */
+#define FD_CHUNK_BITS (6)
+#define FD_CHUNK_SZ (1 << FD_CHUNK_BITS)
+#define FD_CHUNK_MASK (FD_CHUNK_SZ - 1)
+
+/* Poll mask bit for subscriptions, never passed to the kernel. */
+#define MASK_PERSISTENT (1 << 30)
+
+/* user_data: generation in top half, fd in bottom. Completions of
+ * requests from older generations are ignored. */
+#define UD_REMOVE (~0ULL)
+#define make_ud(fd, gen) (((unsigned long long)(gen) << 32) | (unsigned)(fd))
+#define ud_fd(ud) ((int)((ud) & 0xFFFFFFFF))
+#define ud_gen(ud) ((unsigned)((ud) >> 32))
+
+struct local_interest {
+	msock_pid_t victim;
+	struct timer_head timer;
+};
+
+struct local_item {
+	struct list_head in_list;
+	int fd;
+	int new_mask;
+	int poll_mask;		/* mask of the armed request, 0 if none */
+	unsigned gen;
+	/* Read interest wants the data, not readiness: 0 or the
+	 * MSG_FD_REGISTER_RECV* message. */
+	int recv;
+	/* Interests ended by timeout or unregister, after which fds get
+	 * closed. The number could have been reused while the old poll
+	 * request still holds the old file. */
+	int dropped;
+	struct local_data *sd;
+	struct local_interest rd;
+	struct local_interest wr;
+};
+
+struct local_data {
+	struct uring ring;
+	int pipe_read;
+	int map_sz;
+	int chunks_sz;
+	struct local_item **chunks;
+
+	struct list_head changed;
+	struct timer_base tbase;
+
+	struct dgram_stash dgrams;
+};
+
+static int process_callback(int msg_type,
+			    void *msg_payload,
+			    int msg_payload_sz,
+			    void *process_data);
+
+static void schedule_change(struct local_data *sd,
+			    struct local_item *li,
+			    int new_mask);
+static void interest_set(struct local_data *sd,
+			 struct local_interest *in,
+			 msock_pid_t victim,
+			 unsigned long expires);
+static struct local_item *fd_to_item_alloc(struct local_data *sd, int fd);
+
+static void timer_read_callback(struct timer_head *timer);
+static void timer_write_callback(struct timer_head *timer);
+
+static msock_pid_t uring_engine_new(struct base *base,
+				    struct engine_proto *proto)
+{
+	struct local_data *sd = type_malloc(struct local_data);
+	sd->map_sz = get_max_open_files();
+	sd->chunks_sz = (sd->map_sz + FD_CHUNK_SZ - 1) / FD_CHUNK_SZ;
+	sd->chunks = (struct local_item**) \
+		calloc(sd->chunks_sz, sizeof(struct local_item*));
+	if (sd->chunks == NULL) {
+		pfatal("calloc()");
+	}
+
+	if (uring_init(&sd->ring, URING_ENTRIES) != 0) {
+		pfatal("io_uring_setup()");
+	}
+	INIT_LIST_HEAD(&sd->changed);
+
+	set_msock_now_msecs();
+
+	INIT_TIMER_BASE(&sd->tbase, msock_now_msecs);
+
+
+	int pipefd[2];
+	if (pipe(pipefd) != 0) {
+		pfatal("pipe()");
+	}
+	set_nonblocking(pipefd[0]);
+	set_nonblocking(pipefd[1]);
+	sd->pipe_read = pipefd[0];
+
+	struct domain *domain = domain_new(base, proto, (void*)(long)pipefd[1], 1);
+	msock_pid_t pid = spawn(domain, process_callback, sd, PROCOPT_HUNGRY);
+
+	struct local_item *li = fd_to_item_alloc(sd, sd->pipe_read);
+	interest_set(sd, &li->rd, pid, 0);
+	schedule_change(sd, li, POLLIN | MASK_PERSISTENT);
+	return pid;
+}
+
+static void uring_constructor(struct base *base,
+			      struct engine_proto *proto,
+			      int user_max_processes)
+{
+	int engines = max(1, base->options.select_engines);
+	if (engines > ARRAY_SIZE(base->select_pids)) {
+		fatal("Too many select engines.");
+	}
+
+	int i;
+	for (i=0; i < engines; i++) {
+		base->select_pids[i] = uring_engine_new(base, proto);
+	}
+	base->select_engines = engines;
+	msock_register(base, base->select_pids[0], PID_SELECT);
+}
+
+static void uring_data_free(struct local_data *sd)
+{
+	dgram_stash_free(get_current_process()->domain, &sd->dgrams);
+	uring_free(&sd->ring);
+	close(sd->pipe_read);
+	int i;
+	for (i=0; i < sd->chunks_sz; i++) {
+		if (sd->chunks[i]) {
+			msock_safe_free(sizeof(struct local_item) * FD_CHUNK_SZ,
+					sd->chunks[i]);
+		}
+	}
+	free(sd->chunks);
+	type_free(struct local_data, sd);
+}
+
+
+static void uring_destructor(void *ingress_callback_data)
+{
+	int pipe_write = (long)ingress_callback_data;
+	close(pipe_write);
+}
+
+static void uring_ingress_callback(void *ingress_callback_data) {
+	int pipe_write = (long)ingress_callback_data;
+	int r = write(pipe_write, "x", 1);
+	if (r == -1 && errno != EAGAIN) {
+		perror("write(pipe)");
+	}
+}
+
+static struct engine_proto engine_uring = {
+	.name = "uring",
+	.constructor = uring_constructor,
+	.destructor = uring_destructor,
+	.ingress_callback = uring_ingress_callback
+};
+
+REGISTER_ENGINE(MSOCK_ENGINE_MASK_SELECT, &engine_uring);
+
+
+static struct local_item *chunk_alloc(struct local_data *sd, int fd)
+{
+	struct local_item *chunk = (struct local_item*) \
+		msock_safe_malloc(sizeof(struct local_item) * FD_CHUNK_SZ);
+	int base_fd = fd & ~FD_CHUNK_MASK;
+	int i;
+	for (i=0; i < FD_CHUNK_SZ; i++) {
+		struct local_item *li = &chunk[i];
+		li->fd = base_fd + i;
+		INIT_LIST_HEAD(&li->in_list);
+		INIT_TIMER_HEAD(&li->rd.timer, timer_read_callback);
+		INIT_TIMER_HEAD(&li->wr.timer, timer_write_callback);
+		li->sd = sd;
+	}
+	sd->chunks[fd >> FD_CHUNK_BITS] = chunk;
+	return chunk;
+}
+
+static inline struct local_item *fd_to_item(struct local_data *sd, int fd)
+{
+	if (unlikely(fd < 0 || fd >= sd->map_sz)) {
+		return NULL;
+	}
+	struct local_item *chunk = sd->chunks[fd >> FD_CHUNK_BITS];
+	if (unlikely(chunk == NULL)) {
+		return NULL;
+	}
+	return &chunk[fd & FD_CHUNK_MASK];
+}
+
+static struct local_item *fd_to_item_alloc(struct local_data *sd, int fd)
+{
+	if (unlikely(fd < 0 || fd >= sd->map_sz)) {
+		fatal("Bad fd %i.", fd);
+	}
+	struct local_item *chunk = sd->chunks[fd >> FD_CHUNK_BITS];
+	if (unlikely(chunk == NULL)) {
+		chunk = chunk_alloc(sd, fd);
+	}
+	return &chunk[fd & FD_CHUNK_MASK];
+}
+
+
+static void schedule_change(struct local_data *sd,
+			    struct local_item *li,
+			    int new_mask)
+{
+	li->new_mask = new_mask;
+	/* Subscription is always re-armed, so is an fd that might have
+	 * been closed. */
+	if (li->new_mask == li->poll_mask && !(new_mask & MASK_PERSISTENT) &&
+	    !(li->dropped && new_mask)) {
+		if (!list_empty(&li->in_list)) {
+			list_del_init(&li->in_list);
+		}
+	} else {
+		if (list_empty(&li->in_list)) {
+			list_add_tail(&li->in_list,
+				      &sd->changed);
+		}
+	}
+}
+
+static void interest_set(struct local_data *sd,
+			 struct local_interest *in,
+			 msock_pid_t victim,
+			 unsigned long expires)
+{
+	in->victim = victim;
+	if (victim && expires) {
+		timer_add(&in->timer,
+			  expires,
+			  &sd->tbase);
+	} else {
+		timer_del(&in->timer);
+	}
+}
+
+static int item_mask(struct local_item *li)
+{
+	int mask = 0;
+	if (li->rd.victim) {
+		mask |= POLLIN;
+	}
+	if (li->wr.victim) {
+		mask |= POLLOUT;
+	}
+	if (mask && (li->new_mask & MASK_PERSISTENT)) {
+		mask |= MASK_PERSISTENT;
+	}
+	return mask;
+}
+
+static void item_clear(struct local_data *sd, struct local_item *li)
+{
+	interest_set(sd, &li->rd, NULL, 0);
+	interest_set(sd, &li->wr, NULL, 0);
+	schedule_change(sd, li, 0);
+}
+
+static void interest_timeout(struct local_item *li, struct local_interest *in)
+{
+	struct msock_msg_fd msg;
+	msg.fd = li->fd;
+	msg.victim = NULL;
+	msock_send(in->victim, MSG_FD_TIMEOUTED, (void*)&msg, sizeof(msg));
+	li->dropped = 1;
+	if (li->new_mask & MASK_PERSISTENT) {
+		item_clear(li->sd, li);
+	} else {
+		interest_set(li->sd, in, NULL, 0);
+		schedule_change(li->sd, li, item_mask(li));
+	}
+}
+
+static void timer_read_callback(struct timer_head *timer) {
+	struct local_item *li = \
+		container_of(timer, struct local_item, rd.timer);
+	interest_timeout(li, &li->rd);
+}
+
+static void timer_write_callback(struct timer_head *timer) {
+	struct local_item *li = \
+		container_of(timer, struct local_item, wr.timer);
+	interest_timeout(li, &li->wr);
+}
+
+static void send_msg_helper(msock_pid_t victim, int msg_type, int fd) {
+	struct msock_msg_fd msg;
+	msg.fd = fd;
+	msg.victim = NULL;
+	msock_send(victim, msg_type, (void*)&msg, sizeof(msg));
+}
+
+static void send_recv_msg(msock_pid_t victim, int fd, int len,
+			  int saved_errno, char *buf)
+{
+	struct msock_msg_fd_recv msg;
+	msg.fd = fd;
+	msg.len = len;
+	msg.saved_errno = saved_errno;
+	msg.buf = buf;
+	msock_send(victim, MSG_FD_RECV, (void*)&msg, sizeof(msg));
+}
+
+/* Reads the data for MSG_FD_REGISTER_RECV*. Returns 0 if there was
+ * nothing to read after all, -1 if the stream ended and 1 otherwise. */
+static int recv_to_victim(struct local_item *li)
+{
+	struct domain *domain = get_current_process()->domain;
+	if (li->recv == MSG_FD_REGISTER_RECV_DGRAMS) {
+		return dgrams_recv(domain, &li->sd->dgrams, li->fd,
+				   li->rd.victim);
+	}
+	char *buf = buffer_alloc(domain);
+
+	int r = read(li->fd, buf, MSOCK_BUF_SZ);
+	if (r > 0) {
+		send_recv_msg(li->rd.victim, li->fd, r, 0, buf);
+		return 1;
+	}
+	buffer_free(domain, buf);
+	if (r == -1 && (errno == EAGAIN || errno == EINTR)) {
+		return 0;
+	}
+	send_recv_msg(li->rd.victim, li->fd, r, r == -1 ? errno : 0, NULL);
+	return -1;
+}
+
+/* Multishot: every wakeup is reported, registration stays. */
+static void process_event_persistent(struct local_item *li, int events)
+{
+	if (events & (POLLIN | POLLOUT)) {
+		if (events & POLLIN) {
+			send_msg_helper(li->rd.victim, MSG_FD_READ, li->fd);
+		}
+		if (events & POLLOUT) {
+			send_msg_helper(li->wr.victim, MSG_FD_WRITE, li->fd);
+		}
+	} else {
+		send_msg_helper(li->rd.victim, MSG_FD_CLOSE, li->fd);
+	}
+}
+
+/* One shot: satisfied interests are dropped, the other one stays. */
+static void process_event(struct local_data *sd, struct local_item *li,
+			  int events)
+{
+	int error = events & (POLLERR | POLLHUP | POLLNVAL);
+	msock_pid_t closed = NULL;
+
+	if (li->rd.victim && li->recv && (events & POLLIN || error)) {
+		int r = recv_to_victim(li);
+		if (r != 0) {
+			if (r == -1) {
+				closed = li->rd.victim;
+			}
+			interest_set(sd, &li->rd, NULL, 0);
+		}
+	} else if (li->rd.victim && (events & POLLIN || error)) {
+		if (events & POLLIN) {
+			send_msg_helper(li->rd.victim, MSG_FD_READ, li->fd);
+		} else {
+			send_msg_helper(li->rd.victim, MSG_FD_CLOSE, li->fd);
+			closed = li->rd.victim;
+		}
+		interest_set(sd, &li->rd, NULL, 0);
+	}
+	if (li->wr.victim && (events & POLLOUT || error)) {
+		if (events & POLLOUT) {
+			send_msg_helper(li->wr.victim, MSG_FD_WRITE, li->fd);
+		} else if (li->wr.victim != closed) {
+			send_msg_helper(li->wr.victim, MSG_FD_CLOSE, li->fd);
+		}
+		interest_set(sd, &li->wr, NULL, 0);
+	}
+	schedule_change(sd, li, item_mask(li));
+}
+
+/* All the changes go to the kernel with the next io_uring_enter(). */
+static void submit_changes(struct local_data *sd)
+{
+	struct list_head *head, *safe;
+	list_for_each_safe(head, safe, &sd->changed) {
+		struct local_item *li = \
+			container_of(head, struct local_item, in_list);
+		list_del_init(&li->in_list);
+		li->dropped = 0;
+
+		struct io_uring_sqe *sqe;
+		if (li->poll_mask) {
+			sqe = uring_get_sqe(&sd->ring);
+			sqe->opcode = IORING_OP_POLL_REMOVE;
+			sqe->fd = -1;
+			sqe->addr = make_ud(li->fd, li->gen);
+			sqe->user_data = UD_REMOVE;
+		}
+		li->gen++;
+		if (li->new_mask) {
+			sqe = uring_get_sqe(&sd->ring);
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->fd = li->fd;
+			sqe->poll32_events = li->new_mask & ~MASK_PERSISTENT;
+			if (li->new_mask & MASK_PERSISTENT) {
+				sqe->len = IORING_POLL_ADD_MULTI;
+			}
+			sqe->user_data = make_ud(li->fd, li->gen);
+		}
+		li->poll_mask = li->new_mask;
+	}
+}
+
+static void process_cqe(struct local_data *sd, struct io_uring_cqe *cqe)
+{
+	if (cqe->user_data == UD_REMOVE) {
+		return;
+	}
+	struct local_item *li = fd_to_item(sd, ud_fd(cqe->user_data));
+	if (li == NULL || li->gen != ud_gen(cqe->user_data)) {
+		/* Stale, request was removed or replaced. */
+		return;
+	}
+	int persistent = li->poll_mask & MASK_PERSISTENT;
+	if (!persistent || !(cqe->flags & IORING_CQE_F_MORE)) {
+		/* Request is finished, the kernel doesn't know about it. */
+		li->poll_mask = 0;
+		if (persistent) {
+			schedule_change(sd, li, li->new_mask);
+		}
+	}
+	if (cqe->res == -ECANCELED) {
+		return;
+	}
+	if (cqe->res < 0) {
+		/* Most likely fd got closed, re-arming won't help. */
+		msock_pid_t rd_victim = li->rd.victim;
+		if (rd_victim && li->recv == MSG_FD_REGISTER_RECV_DGRAMS) {
+			dgrams_error(rd_victim, li->fd, -cqe->res);
+		} else if (rd_victim && li->recv) {
+			send_recv_msg(rd_victim, li->fd, -1, -cqe->res, NULL);
+		} else if (rd_victim) {
+			send_msg_helper(rd_victim, MSG_FD_CLOSE, li->fd);
+		}
+		if (li->wr.victim && li->wr.victim != rd_victim) {
+			send_msg_helper(li->wr.victim, MSG_FD_CLOSE, li->fd);
+		}
+		item_clear(sd, li);
+		return;
+	}
+	int events = cqe->res;
+
+	if (li->fd == sd->pipe_read) {
+		char buf[32];
+		while (read(li->fd, buf, sizeof(buf)) > 0) {
+		}
+		return;
+	}
+	if (persistent) {
+		process_event_persistent(li, events);
+	} else {
+		process_event(sd, li, events);
+	}
+}
+
+static void process_block(struct local_data *sd)
+{
+	submit_changes(sd);
+
+	unsigned long delta_msecs = \
+		timer_next_interrupt(&sd->tbase) - msock_now_msecs;
+
+	int r = uring_submit_and_wait(&sd->ring, 1, (long)delta_msecs);
+	if (r == -1) {
+		pfatal("io_uring_enter()");
+	}
+
+	while (1) {
+		struct io_uring_cqe *cqe = uring_peek_cqe(&sd->ring);
+		if (cqe == NULL) {
+			break;
+		}
+		process_cqe(sd, cqe);
+		uring_cqe_seen(&sd->ring);
+	}
+
+	set_msock_now_msecs();
+	timers_run(&sd->tbase, msock_now_msecs);
+}
+
+
+
+static int process_callback(int msg_type,
+			    void *msg_payload,
+			    int msg_payload_sz,
+			    void *process_data)
+{
+	struct local_data *sd = (struct local_data*)process_data;
+	struct msock_msg_fd *msg = (struct msock_msg_fd *)msg_payload;
+	struct local_item *li;
+
+	switch (msg_type) {
+	case MSG_FD_REGISTER_READ:
+	case MSG_FD_REGISTER_WRITE:
+	case MSG_FD_REGISTER_RECV:
+	case MSG_FD_REGISTER_RECV_DGRAMS:
+		li = fd_to_item_alloc(sd, msg->fd);
+		if (li->new_mask & MASK_PERSISTENT) {
+			/* One shot registration replaces subscription. */
+			item_clear(sd, li);
+		}
+		interest_set(sd,
+			     msg_type == MSG_FD_REGISTER_WRITE ? &li->wr : &li->rd,
+			     msg->victim, msg->expires);
+		if (msg_type != MSG_FD_REGISTER_WRITE) {
+			li->recv = msg_type == MSG_FD_REGISTER_READ ?
+				0 : msg_type;
+		}
+		schedule_change(sd, li, item_mask(li));
+		break;
+	case MSG_FD_UNREGISTER:
+		/* Drop only interests of the victim. */
+		li = fd_to_item(sd, msg->fd);
+		if (li == NULL) {
+			break;
+		}
+		li->dropped = 1;
+		if (li->rd.victim == msg->victim) {
+			interest_set(sd, &li->rd, NULL, 0);
+		}
+		if (li->wr.victim == msg->victim) {
+			interest_set(sd, &li->wr, NULL, 0);
+		}
+		schedule_change(sd, li, item_mask(li));
+		break;
+	case MSG_FD_SUBSCRIBE:
+		li = fd_to_item_alloc(sd, msg->fd);
+		interest_set(sd, &li->rd, msg->victim, msg->expires);
+		interest_set(sd, &li->wr, msg->victim, 0);
+		li->recv = 0;
+		schedule_change(sd, li, POLLIN | POLLOUT | MASK_PERSISTENT);
+		break;
+
+	case MSG_EXIT:
+		uring_data_free(sd);
+		return RECV_EXIT;
+
+	case MSG_QUEUE_EMPTY:
+		process_block(sd);
+		return RECV_OK;
+	default:
+		fatal("Broken message %#x", msg_type);
+	}
+
+	return RECV_OK;
+}
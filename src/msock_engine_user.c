@@ -1,13 +1,25 @@
 #include "msock_internal.h"
 
+/* Process table grows on demand, no need to start big. */
+#define USER_INITIAL_PROCESSES (1024)
+
 static void engine_user_constructor(struct base *base,
 				    struct engine_proto *proto,
 				    int user_max_processes)
 {
 	if (user_max_processes == 0) {
-		user_max_processes = get_max_open_files()+1;
+		user_max_processes = USER_INITIAL_PROCESSES;
+	}
+	int domains = max(1, base->options.user_domains);
+	if (domains > ARRAY_SIZE(base->user_domain)) {
+		fatal("Too many user domains.");
+	}
+	int i;
+	for (i=0; i < domains; i++) {
+		base->user_domain[i] = domain_new(base, proto, NULL,
+						  user_max_processes);
 	}
-	domain_new(base, proto, NULL, user_max_processes);
+	base->user_domains = domains;
 	return;
 }
 
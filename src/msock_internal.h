@@ -31,6 +31,7 @@ static inline unsigned long pid_to_poff(msock_pid_t mpid);
 #include "msock_engine_user.h"
 #include "msock_process.h"
 #include "msock_reg.h"
+#include "msock_udp.h"
 #include "msock_worker.h"
 
 
@@ -68,6 +69,18 @@ static inline char *msg_type_tostr(int msg_type) {
 		return "MSG_FD_REGISTER_WRITE";
 	case MSG_FD_UNREGISTER:
 		return "MSG_FD_UNREGISTER";
+	case MSG_FD_SUBSCRIBE:
+		return "MSG_FD_SUBSCRIBE";
+	case MSG_FD_READY_BATCH:
+		return "MSG_FD_READY_BATCH";
+	case MSG_FD_REGISTER_RECV:
+		return "MSG_FD_REGISTER_RECV";
+	case MSG_FD_RECV:
+		return "MSG_FD_RECV";
+	case MSG_FD_REGISTER_RECV_DGRAMS:
+		return "MSG_FD_REGISTER_RECV_DGRAMS";
+	case MSG_FD_RECV_DGRAMS:
+		return "MSG_FD_RECV_DGRAMS";
 	case MSG_QUEUE_EMPTY:
 		return "MSG_QUEUE_EMPTY";
 	case MSG_IO_FSYNC:
@@ -76,6 +89,38 @@ static inline char *msg_type_tostr(int msg_type) {
 		return "MSG_IO_PREAD";
 	case MSG_IO_OPEN:
 		return "MSG_IO_OPEN";
+	case MSG_IO_PWRITE:
+		return "MSG_IO_PWRITE";
+	case MSG_IO_PREADV:
+		return "MSG_IO_PREADV";
+	case MSG_IO_PWRITEV:
+		return "MSG_IO_PWRITEV";
+	case MSG_IO_FDATASYNC:
+		return "MSG_IO_FDATASYNC";
+	case MSG_IO_CLOSE:
+		return "MSG_IO_CLOSE";
+	case MSG_IO_FSTAT:
+		return "MSG_IO_FSTAT";
+	case MSG_IO_SENDFILE:
+		return "MSG_IO_SENDFILE";
+	case MSG_IO_LOG_APPEND:
+		return "MSG_IO_LOG_APPEND";
+	case MSG_IO_BUF_LEASE:
+		return "MSG_IO_BUF_LEASE";
+	case MSG_IO_BUF_RELEASE:
+		return "MSG_IO_BUF_RELEASE";
+	case MSG_IO_STREAM_OPEN:
+		return "MSG_IO_STREAM_OPEN";
+	case MSG_IO_STREAM_CHUNK:
+		return "MSG_IO_STREAM_CHUNK";
+	case MSG_IO_STREAM_DONE:
+		return "MSG_IO_STREAM_DONE";
+	case MSG_IO_STREAM_CLOSE:
+		return "MSG_IO_STREAM_CLOSE";
+	case MSG_PIPE_DONE:
+		return "MSG_PIPE_DONE";
+	case MSG_PIPE_STOP:
+		return "MSG_PIPE_STOP";
 	case MSG_EXIT:
 		return "MSG_EXIT";
 	default:
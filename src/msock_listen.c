@@ -0,0 +1,159 @@
+/* Accepting connections: one SO_REUSEPORT listener per user domain,
+ * new fds are passed to the user in the domain that accepted them. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "msock_internal.h"
+
+/* Out of fds: accepting waits that long before trying again. */
+#define ACCEPT_BACKOFF_MSECS (100)
+
+struct listener {
+	int fd;
+	msock_accept_t accept_cb;
+	void *accept_data;
+	int backoff;
+};
+
+static int listen_socket(struct addrinfo *ai, int backlog)
+{
+	int fd = socket(ai->ai_family,
+			ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			ai->ai_protocol);
+	if (fd == -1) {
+		return -1;
+	}
+	int one = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) ||
+	    bind(fd, ai->ai_addr, ai->ai_addrlen) ||
+	    listen(fd, backlog)) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+	return fd;
+}
+
+/* Edge triggered, so the backlog must be drained. */
+static void accept_all(struct listener *ls)
+{
+	while (1) {
+		int fd = accept4(ls->fd, NULL, NULL,
+				 SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd >= 0) {
+			ls->accept_cb(fd, ls->accept_data);
+			continue;
+		}
+		switch (errno) {
+		case EAGAIN:
+			return;
+		case EINTR:
+		case ECONNABORTED:
+		case EPROTO:
+			continue;
+		default:
+			/* Most likely out of fds. Connections are still
+			 * waiting, re-arming now would spin. A listening
+			 * socket is never writable: this registration
+			 * replaces the subscription and just times out. */
+			perror("accept4()");
+			ls->backoff = 1;
+			msock_send_msg_fd(MSG_FD_REGISTER_WRITE, ls->fd,
+					  ACCEPT_BACKOFF_MSECS);
+			return;
+		}
+	}
+}
+
+static int listener_callback(int msg_type,
+			     void *msg_payload,
+			     int msg_payload_sz,
+			     void *process_data)
+{
+	struct listener *ls = (struct listener *)process_data;
+
+	switch (msg_type) {
+	case MSG_FD_READ:
+		/* Could have been sent before backing off. */
+		if (!ls->backoff) {
+			accept_all(ls);
+		}
+		break;
+	case MSG_FD_WRITE:
+		/* Subscription reports writability too, ignore. */
+		break;
+	case MSG_FD_TIMEOUTED:
+		/* Subscribing again re-arms, waiting connections are
+		 * reported at once. */
+		ls->backoff = 0;
+		msock_send_msg_fd(MSG_FD_SUBSCRIBE, ls->fd, 0);
+		break;
+	case MSG_FD_CLOSE:
+	case MSG_EXIT:
+		close(ls->fd);
+		type_free(struct listener, ls);
+		return RECV_EXIT;
+	default:
+		fatal("Broken message %#x", msg_type);
+	}
+	return RECV_OK;
+}
+
+DLL_PUBLIC int msock_base_listen(msock_base ubase,
+				 const char *host, int port, int backlog,
+				 msock_accept_t accept_cb, void *accept_data)
+{
+	struct base *base = ubase;
+	if (backlog <= 0) {
+		backlog = SOMAXCONN;
+	}
+
+	struct addrinfo hints, *ai;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	char service[16];
+	snprintf(service, sizeof(service), "%i", port);
+	if (getaddrinfo(host, service, &hints, &ai) != 0) {
+		errno = EADDRNOTAVAIL;
+		return -1;
+	}
+
+	/* All sockets first, nothing is spawned if one fails. */
+	int fds[MAX_DOMAINS];
+	int i;
+	for (i=0; i < base->user_domains; i++) {
+		fds[i] = listen_socket(ai, backlog);
+		if (fds[i] == -1) {
+			int saved_errno = errno;
+			while (i--) {
+				close(fds[i]);
+			}
+			freeaddrinfo(ai);
+			errno = saved_errno;
+			return -1;
+		}
+	}
+	freeaddrinfo(ai);
+
+	for (i=0; i < base->user_domains; i++) {
+		struct listener *ls = type_malloc(struct listener);
+		ls->fd = fds[i];
+		ls->accept_cb = accept_cb;
+		ls->accept_data = accept_data;
+		ls->backoff = 0;
+		msock_pid_t pid = spawn(base->user_domain[i],
+					listener_callback, ls, 0);
+		msock_base_send_msg_fd(base, pid, MSG_FD_SUBSCRIBE, ls->fd, 0);
+	}
+	return 0;
+}
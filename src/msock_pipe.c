@@ -0,0 +1,187 @@
+/* Proxying without copying: splice() from one fd into a pipe and from
+ * the pipe into the other, each time the select engine says it's ready. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "msock_internal.h"
+
+/* Asked for, the kernel may give less. Bigger pipe, fewer splices. */
+#define PIPE_SZ (256*1024)
+/* Most a single splice() takes, the pipe size limits it anyway. */
+#define SPLICE_MAX (1 << 20)
+
+struct pipe_job {
+	int in_fd;
+	int out_fd;
+	int pipe[2];
+	/* Bytes in the pipe, not yet in 'out_fd'. */
+	size_t in_pipe;
+	uint64_t count;
+	int eof;
+	msock_pid_t owner;
+};
+
+static int pipe_get(struct domain *domain, int p[2])
+{
+	if (domain->pipes_kept) {
+		domain->pipes_kept--;
+		p[0] = domain->pipes[domain->pipes_kept][0];
+		p[1] = domain->pipes[domain->pipes_kept][1];
+		return 0;
+	}
+	if (pipe2(p, O_NONBLOCK | O_CLOEXEC)) {
+		return -1;
+	}
+	/* Not fatal, the default size works too. */
+	fcntl(p[1], F_SETPIPE_SZ, PIPE_SZ);
+	return 0;
+}
+
+/* Only an empty pipe may be used again. */
+static void pipe_put(struct domain *domain, int p[2], int empty)
+{
+	if (empty && domain->pipes_kept < PIPES_KEPT) {
+		domain->pipes[domain->pipes_kept][0] = p[0];
+		domain->pipes[domain->pipes_kept][1] = p[1];
+		domain->pipes_kept++;
+		return;
+	}
+	close(p[0]);
+	close(p[1]);
+}
+
+DLL_LOCAL void pipes_free(struct domain *domain)
+{
+	while (domain->pipes_kept) {
+		domain->pipes_kept--;
+		close(domain->pipes[domain->pipes_kept][0]);
+		close(domain->pipes[domain->pipes_kept][1]);
+	}
+}
+
+static void job_done(struct pipe_job *job, int saved_errno)
+{
+	struct msock_msg_pipe msg;
+	msg.in_fd = job->in_fd;
+	msg.out_fd = job->out_fd;
+	msg.count = job->count;
+	msg.saved_errno = saved_errno;
+	msock_send(job->owner, MSG_PIPE_DONE, (void*)&msg, sizeof(msg));
+
+	pipe_put(get_current_process()->domain, job->pipe, job->in_pipe == 0);
+	type_free(struct pipe_job, job);
+}
+
+/* Splices until an fd would block and waits for it. The pipe is emptied
+ * before reading more, so only one fd is waited for at a time. Returns
+ * 1 once the job is done and freed. */
+static int job_pump(struct pipe_job *job)
+{
+	while (1) {
+		while (job->in_pipe) {
+			ssize_t r = splice(job->pipe[0], NULL,
+					   job->out_fd, NULL, job->in_pipe,
+					   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (r == -1 && errno == EINTR) {
+				continue;
+			}
+			if (r == -1 && errno == EAGAIN) {
+				msock_send_msg_fd(MSG_FD_REGISTER_WRITE,
+						  job->out_fd, 0);
+				return 0;
+			}
+			if (r <= 0) {
+				job_done(job, r == -1 ? errno : EPIPE);
+				return 1;
+			}
+			job->in_pipe -= r;
+			job->count += r;
+		}
+		if (job->eof) {
+			job_done(job, 0);
+			return 1;
+		}
+
+		ssize_t r = splice(job->in_fd, NULL, job->pipe[1], NULL,
+				   SPLICE_MAX,
+				   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (r == -1 && errno == EINTR) {
+			continue;
+		}
+		if (r == -1 && errno == EAGAIN) {
+			msock_send_msg_fd(MSG_FD_REGISTER_READ, job->in_fd, 0);
+			return 0;
+		}
+		if (r == -1) {
+			job_done(job, errno);
+			return 1;
+		}
+		if (r == 0) {
+			job->eof = 1;
+		}
+		job->in_pipe += r;
+	}
+}
+
+static int pipe_callback(int msg_type,
+			 void *msg_payload,
+			 int msg_payload_sz,
+			 void *process_data)
+{
+	struct pipe_job *job = (struct pipe_job *)process_data;
+
+	switch (msg_type) {
+	case MSG_FD_READ:
+	case MSG_FD_WRITE:
+	case MSG_FD_CLOSE:
+		/* Errors show up in splice(). */
+		if (job_pump(job)) {
+			return RECV_EXIT;
+		}
+		break;
+	case MSG_PIPE_STOP:
+		/* Drops only interests of this process. */
+		msock_send_msg_fd(MSG_FD_UNREGISTER, job->in_fd, 0);
+		msock_send_msg_fd(MSG_FD_UNREGISTER, job->out_fd, 0);
+		job_done(job, ECANCELED);
+		return RECV_EXIT;
+	case MSG_EXIT:
+		close(job->pipe[0]);
+		close(job->pipe[1]);
+		type_free(struct pipe_job, job);
+		return RECV_EXIT;
+	default:
+		fatal("Broken message %#x", msg_type);
+	}
+	return RECV_OK;
+}
+
+DLL_PUBLIC msock_pid_t msock_pipe_fds(int in_fd, int out_fd)
+{
+	struct domain *domain = get_current_process()->domain;
+	struct pipe_job *job = type_malloc(struct pipe_job);
+	if (pipe_get(domain, job->pipe)) {
+		int saved_errno = errno;
+		type_free(struct pipe_job, job);
+		errno = saved_errno;
+		return NULL;
+	}
+	job->in_fd = in_fd;
+	job->out_fd = out_fd;
+	job->in_pipe = 0;
+	job->count = 0;
+	job->eof = 0;
+	job->owner = msock_self();
+
+	msock_pid_t pid = spawn(domain, pipe_callback, job, 0);
+	msock_victim_send_msg_fd(pid, MSG_FD_REGISTER_READ, in_fd, 0);
+	return pid;
+}
+
+DLL_PUBLIC void msock_pipe_stop(msock_pid_t pipe)
+{
+	msock_send(pipe, MSG_PIPE_STOP, NULL, 0);
+}
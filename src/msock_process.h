@@ -14,6 +14,10 @@ struct process {
 
 	msock_pid_t pid;
 	struct list_head in_hungry_list;
+
+	/* Set by msock_io_set_class() */
+	int io_class;
+	unsigned long io_timeout_msecs;
 };
 
 DLL_LOCAL struct process *process_new(struct domain *domain,
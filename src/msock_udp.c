@@ -0,0 +1,161 @@
+/* Datagrams: many of them per recvmmsg() and sendmmsg(), each one in a
+ * buffer of the receive pool. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "msock_internal.h"
+
+/* Datagrams handed to a single sendmmsg(). */
+#define UDP_SEND_BATCH (64)
+
+
+DLL_PUBLIC int msock_udp_bind(const char *host, int port)
+{
+	struct addrinfo hints, *ai;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_PASSIVE;
+	char service[16];
+	snprintf(service, sizeof(service), "%i", port);
+	if (getaddrinfo(host, service, &hints, &ai) != 0) {
+		errno = EADDRNOTAVAIL;
+		return -1;
+	}
+
+	int fd = socket(ai->ai_family,
+			ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			ai->ai_protocol);
+	if (fd != -1) {
+		int one = 1;
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+		    bind(fd, ai->ai_addr, ai->ai_addrlen)) {
+			int saved_errno = errno;
+			close(fd);
+			errno = saved_errno;
+			fd = -1;
+		}
+	}
+	freeaddrinfo(ai);
+	return fd;
+}
+
+DLL_PUBLIC int msock_udp_sendv(int fd, struct msock_dgram **dgrams, int count)
+{
+	int sent = 0;
+	while (sent < count) {
+		struct mmsghdr mm[UDP_SEND_BATCH];
+		struct iovec iov[UDP_SEND_BATCH];
+		int n = min(count - sent, UDP_SEND_BATCH);
+		int i;
+		memset(mm, 0, sizeof(struct mmsghdr) * n);
+		for (i=0; i < n; i++) {
+			struct msock_dgram *d = dgrams[sent + i];
+			iov[i].iov_base = d->data;
+			iov[i].iov_len = d->len;
+			if (d->addr_len) {
+				mm[i].msg_hdr.msg_name = &d->addr;
+				mm[i].msg_hdr.msg_namelen = d->addr_len;
+			}
+			mm[i].msg_hdr.msg_iov = &iov[i];
+			mm[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int r = sendmmsg(fd, mm, n, MSG_DONTWAIT);
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return sent ? sent : -1;
+		}
+		sent += r;
+		if (r < n) {
+			/* Socket buffer is full. */
+			break;
+		}
+	}
+	return sent;
+}
+
+DLL_LOCAL void dgrams_error(msock_pid_t victim, int fd, int saved_errno)
+{
+	struct msock_msg_fd_dgrams msg;
+	msg.fd = fd;
+	msg.count = 0;
+	msg.saved_errno = saved_errno;
+	msock_send(victim, MSG_FD_RECV_DGRAMS, (void*)&msg,
+		   offsetof(struct msock_msg_fd_dgrams, dgrams));
+}
+
+DLL_LOCAL int dgrams_recv(struct domain *domain, struct dgram_stash *stash,
+			  int fd, msock_pid_t victim)
+{
+	BUILD_BUG_ON(sizeof(struct msock_msg_fd_dgrams) > MAX_MSG_PAYLOAD_SZ);
+
+	while (stash->count < MSOCK_DGRAM_BATCH) {
+		stash->bufs[stash->count++] = \
+			(struct msock_dgram *)buffer_alloc(domain);
+	}
+	struct mmsghdr mm[MSOCK_DGRAM_BATCH];
+	struct iovec iov[MSOCK_DGRAM_BATCH];
+	memset(mm, 0, sizeof(mm));
+	int i;
+	for (i=0; i < MSOCK_DGRAM_BATCH; i++) {
+		struct msock_dgram *d = stash->bufs[i];
+		iov[i].iov_base = d->data;
+		iov[i].iov_len = MSOCK_DGRAM_MAX;
+		mm[i].msg_hdr.msg_name = &d->addr;
+		mm[i].msg_hdr.msg_namelen = sizeof(d->addr);
+		mm[i].msg_hdr.msg_iov = &iov[i];
+		mm[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int r;
+	do {
+		r = recvmmsg(fd, mm, MSOCK_DGRAM_BATCH, MSG_DONTWAIT, NULL);
+	} while (r == -1 && errno == EINTR);
+	if (r == -1 && errno == EAGAIN) {
+		return 0;
+	}
+	if (r == -1) {
+		dgrams_error(victim, fd, errno);
+		return -1;
+	}
+
+	struct msock_msg_fd_dgrams msg;
+	msg.fd = fd;
+	msg.count = r;
+	msg.saved_errno = 0;
+	for (i=0; i < r; i++) {
+		struct msock_dgram *d = stash->bufs[i];
+		d->addr_len = mm[i].msg_hdr.msg_namelen;
+		d->len = mm[i].msg_len;
+		d->truncated = !!(mm[i].msg_hdr.msg_flags & MSG_TRUNC);
+		msg.dgrams[i] = d;
+	}
+	/* Unused buffers stay for the next time. */
+	stash->count -= r;
+	memmove(stash->bufs, stash->bufs + r,
+		sizeof(struct msock_dgram *) * stash->count);
+
+	msock_send(victim, MSG_FD_RECV_DGRAMS, (void*)&msg,
+		   offsetof(struct msock_msg_fd_dgrams, dgrams) +
+		   sizeof(struct msock_dgram *) * r);
+	return 1;
+}
+
+DLL_LOCAL void dgram_stash_free(struct domain *domain,
+				struct dgram_stash *stash)
+{
+	int i;
+	for (i=0; i < stash->count; i++) {
+		buffer_free(domain, (char*)stash->bufs[i]);
+	}
+	stash->count = 0;
+}
@@ -0,0 +1,18 @@
+#ifndef _MSOCK_UDP_H
+#define _MSOCK_UDP_H
+
+/* Pool buffers kept by a select engine for the next recvmmsg(). */
+struct dgram_stash {
+	int count;
+	struct msock_dgram *bufs[MSOCK_DGRAM_BATCH];
+};
+
+/* Reads datagrams for MSG_FD_REGISTER_RECV_DGRAMS. Returns 0 if there was
+ * nothing to read after all, -1 on error and 1 otherwise. */
+DLL_LOCAL int dgrams_recv(struct domain *domain, struct dgram_stash *stash,
+			  int fd, msock_pid_t victim);
+DLL_LOCAL void dgrams_error(msock_pid_t victim, int fd, int saved_errno);
+DLL_LOCAL void dgram_stash_free(struct domain *domain,
+				struct dgram_stash *stash);
+
+#endif // _MSOCK_UDP_H
@@ -75,6 +75,17 @@ DLL_LOCAL unsigned long long now_msecs()
 		(unsigned long long)ts.tv_nsec / 1000000;
 }
 
+DLL_LOCAL unsigned long long now_usecs()
+{
+	struct timespec ts = {0, 0};
+	int r = clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (r != 0) {
+		pfatal("clock_gettime(CLOCK_MONOTONIC)");
+	}
+	return (unsigned long long)ts.tv_sec * 1000000L + \
+		(unsigned long long)ts.tv_nsec / 1000;
+}
+
 DLL_PUBLIC unsigned long msock_now_msecs;
 
 DLL_LOCAL void set_msock_now_msecs()
@@ -57,6 +57,7 @@ DLL_LOCAL void pfatal(const char *fmt, ...) __attribute__ ((format (printf, 1, 2
 DLL_LOCAL void safe_printf(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 DLL_LOCAL int get_max_open_files();
 DLL_LOCAL unsigned long long now_msecs();
+DLL_LOCAL unsigned long long now_usecs();
 DLL_LOCAL void set_msock_now_msecs();
 DLL_LOCAL void set_nonblocking(int fd);
 
@@ -46,14 +46,43 @@ DLL_LOCAL void workers_join(struct base *base)
 	}
 }
 
+/* Domains without hungry processes can't be woken up. If one has
+ * messages waiting, nobody may block until it's run. Senders are never
+ * blocked, so checking before blocking is enough. A domain being run by
+ * another thread doesn't count: that thread checks again before it
+ * blocks. Waiting for it here would spin until it's scheduled, a whole
+ * time slice if it was preempted. Hungry processes only come and go
+ * with the engines, at start and shutdown. */
+static int pending_non_hungry(struct base *base)
+{
+	struct list_head *head;
+	list_for_each(head, &base->list_of_domains) {
+		struct domain *domain = \
+			container_of(head, struct domain, in_list);
+		if (!list_empty(&domain->list_of_hungry_processes) ||
+		    msqueue_is_enqueued(&domain->in_queue)) {
+			continue;
+		}
+		spin_lock(&domain->remote_inbox_lock);
+		int pending = !queue_empty(&domain->remote_inbox);
+		spin_unlock(&domain->remote_inbox_lock);
+		if (pending) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
 static void worker_domain_run(struct domain *domain)
 {
 	int egress_msgs = domain_run(domain);
 
 	/* Haven't send anything abroad and has hungry processes. */
-	if (!egress_msgs && !list_empty(&domain->list_of_hungry_processes)) {
-		struct list_head *head;
-		list_for_each(head, &domain->list_of_hungry_processes) {
+	if (!egress_msgs && !list_empty(&domain->list_of_hungry_processes)
+	    && !pending_non_hungry(domain->base)) {
+		/* Process can exit while running. */
+		struct list_head *head, *safe;
+		list_for_each_safe(head, safe, &domain->list_of_hungry_processes) {
 			struct process *process = \
 				container_of(head, struct process, in_hungry_list);
 			send_indirect(domain,
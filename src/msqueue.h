@@ -1,14 +1,16 @@
 #ifndef MSQUEUE_H
 #define MSQUEUE_H
 /*
- * Simple, memory-efficient implementation of a lock-free queue.
+ * Simple, memory-efficient implementation of a concurrent queue.
  *
  * Take a look on the "Simple, Fast and Practical Non-Blocking
  * Concurrent Queue Alorithms" paper by Maged Michael and Michael Scott.
  * It explains where the complexity lays.
  *
  * I tried to implement the algorithm described there. With the simplification
- * which affect the avoidance ABA problem. So we _are_ affected by ABA. Beware.
+ * which affect the avoidance ABA problem. Items are put back right after
+ * being taken, so with a few items ABA does happen - put and get are
+ * serialized with a spinlock.
  *
  * The main reasons that lead us to create this implementation:
  *       - Well tested implementation, that doesn't fight with Helgrind.
@@ -17,6 +19,8 @@
 
 #include <stdlib.h>
 
+#include "spinlock.h"
+
 #define MSQUEUE_POISON1 0xCAFEBAB5
 
 #ifndef _cas
@@ -28,6 +32,7 @@ struct msqueue_head {
 };
 
 struct msqueue_root {
+	spinlock_t lock;
 	struct msqueue_head *head;
 	struct msqueue_head *tail;
 
@@ -36,6 +41,7 @@ struct msqueue_root {
 
 static inline void INIT_MSQUEUE_ROOT(struct msqueue_root *root)
 {
+	INIT_SPIN_LOCK(&root->lock);
 	root->divider.next = NULL;
 	root->head = &root->divider;
 	root->tail = &root->divider;
@@ -46,16 +52,19 @@ static inline void INIT_MSQUEUE_HEAD(struct msqueue_head *head)
 	head->next = (void*)MSQUEUE_POISON1;
 }
 
+/* Confusingly, true if the item was taken out of the queue. Can be
+ * asked without the lock, the answer may be stale then. */
 static inline int msqueue_is_enqueued(struct msqueue_head *head)
 {
-	if (head->next == (void*)MSQUEUE_POISON1) {
+	if (__atomic_load_n(&head->next, __ATOMIC_ACQUIRE) ==
+	    (void*)MSQUEUE_POISON1) {
 		return 1;
 	}
 	return 0;
 }
 
-static inline void msqueue_put(struct msqueue_head *new,
-			     struct msqueue_root *root)
+static inline void _msqueue_put(struct msqueue_head *new,
+				struct msqueue_root *root)
 {
 	if ( !_cas(&new->next, new->next, NULL) ) {
 		abort();
@@ -80,7 +89,7 @@ static inline void msqueue_put(struct msqueue_head *new,
 	_cas(&root->tail, tail, new);
 }
 
-static inline struct msqueue_head *msqueue_get(struct msqueue_root *root)
+static inline struct msqueue_head *_msqueue_get(struct msqueue_root *root)
 {
 	while (1) {
 		struct msqueue_head *head = root->head;
@@ -97,7 +106,7 @@ static inline struct msqueue_head *msqueue_get(struct msqueue_root *root)
 		} else {
 			if (_cas(&root->head, head, next)) {
 				if (head == &root->divider) {
-					msqueue_put(&root->divider, root);
+					_msqueue_put(&root->divider, root);
 					continue;
 				}
 				if( !_cas(&head->next, next, (void*)MSQUEUE_POISON1)) {
@@ -109,4 +118,20 @@ static inline struct msqueue_head *msqueue_get(struct msqueue_root *root)
 	}
 }
 
+static inline void msqueue_put(struct msqueue_head *new,
+			       struct msqueue_root *root)
+{
+	spin_lock(&root->lock);
+	_msqueue_put(new, root);
+	spin_unlock(&root->lock);
+}
+
+static inline struct msqueue_head *msqueue_get(struct msqueue_root *root)
+{
+	spin_lock(&root->lock);
+	struct msqueue_head *head = _msqueue_get(root);
+	spin_unlock(&root->lock);
+	return head;
+}
+
 #endif // MSQUEUE_H
@@ -0,0 +1,47 @@
+#ifndef _SCAN_H
+#define _SCAN_H
+/*
+ * Finding a byte in a buffer, a vector at a time. The widest unit the
+ * compiler targets is used, -march=native picks it.
+ */
+
+#include <stddef.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* Returns the first 'c' in [p, end) or NULL. */
+static inline const char *scan_byte(const char *p, const char *end, char c)
+{
+#ifdef __AVX2__
+	__m256i c32 = _mm256_set1_epi8(c);
+	while (end - p >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)p);
+		unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, c32));
+		if (mask) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 32;
+	}
+#endif
+#ifdef __SSE2__
+	__m128i c16 = _mm_set1_epi8(c);
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, c16));
+		if (mask) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 16;
+	}
+#endif
+	for (; p < end; p++) {
+		if (*p == c) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+#endif // _SCAN_H
@@ -8,61 +8,90 @@
 #include "list.h"
 
 
+static void umap_grow(struct umap_root *root)
+{
+	int seg = root->segments;
+	if (seg >= UMAP_MAX_SEGMENTS) {
+		return;
+	}
+	ulong seg_sz = 1UL << (root->seg0_bits + (seg ? seg - 1 : 0));
+	root->data[seg] = (struct umap_data*)calloc(seg_sz, sizeof(struct umap_data));
+	root->meta[seg] = (struct umap_meta*)calloc(seg_sz, sizeof(struct umap_meta));
+	if (root->data[seg] == NULL || root->meta[seg] == NULL) {
+		pfatal("calloc()");
+	}
+
+	ulong i;
+	for (i=0; i < seg_sz; i++) {
+		struct umap_meta *meta = &root->meta[seg][i];
+		meta->idx = root->map_sz + i;
+		INIT_QUEUE_HEAD(&meta->in_queue);
+	}
+	root->segments++;
+	root->map_sz += seg_sz;
+}
+
 DLL_LOCAL struct umap_root *umap_new(size_t map_sz, ulong max_counter)
 {
 	struct umap_root *root =  \
 		(struct umap_root *)calloc(1, sizeof(struct umap_root));
 
-	root->counter = 1;
+	/* Slot 0 is never used - that makes sure number 0 is never given. */
+	int bits = 1;
+	while ((1UL << bits) < map_sz + 1 && bits < UMAP_IDX_BITS) {
+		bits++;
+	}
+	root->seg0_bits = bits;
 	root->max_counter = max_counter;
-	root->map_sz = map_sz;
-	root->data = (struct umap_data*)calloc(map_sz, sizeof(struct umap_data));
-	root->meta = (struct umap_meta*)calloc(map_sz, sizeof(struct umap_meta));
+	root->high = 1;
 	INIT_QUEUE_ROOT(&root->free_items);
 
-	int i;
-	for (i=0; i < map_sz; i++) {
-		struct umap_meta *meta = &root->meta[i];
-		meta->idx = i;
-		INIT_QUEUE_HEAD(&meta->in_queue);
-		queue_put(&meta->in_queue, &root->free_items);
-	}
+	umap_grow(root);
 	return root;
 }
 
 DLL_LOCAL void umap_free(struct umap_root *root)
 {
-	free(root->data);
-	free(root->meta);
+	int seg;
+	for (seg=0; seg < root->segments; seg++) {
+		free(root->data[seg]);
+		free(root->meta[seg]);
+	}
 	free(root);
 }
 
 /* Allocate new number, return 0 if no slots are free. */
 DLL_LOCAL ulong umap_add(struct umap_root *root, void *ptr)
 {
+	ulong idx;
 	struct queue_head *head = queue_get(&root->free_items);
-	if (!head) {
-		return 0;
+	if (head) {
+		struct umap_meta *meta = \
+			container_of(head, struct umap_meta, in_queue);
+		idx = meta->idx;
+	} else {
+		if (root->high == root->map_sz) {
+			umap_grow(root);
+		}
+		if (root->high == root->map_sz || root->high > UMAP_IDX_MASK) {
+			return 0;
+		}
+		idx = root->high++;
 	}
 
-	struct umap_meta *meta = container_of(head, struct umap_meta, in_queue);
-	struct umap_data *data = &root->data[meta->idx];
-count_again:;
-	/* (counter + x) mod sz = idx      (assumption: x != 0) */
-	int x = (root->map_sz + meta->idx -
-		 (root->counter % root->map_sz)) % root->map_sz;
-	if (x == 0) {
-		x = root->map_sz;
-	}
-	root->counter += x;
-	if (root->counter >= root->max_counter) {
-		root->counter = 0;
-		goto count_again;
+	ulong off;
+	int seg = umap_idx_to_seg(root, idx, &off);
+	struct umap_meta *meta = &root->meta[seg][off];
+	struct umap_data *data = &root->data[seg][off];
+
+	ulong no = (meta->gen << UMAP_IDX_BITS) | idx;
+	if (no >= root->max_counter) {
+		meta->gen = 0;
+		no = idx;
 	}
 
-	data->no = root->counter;
-	assert(data->no % root->map_sz == meta->idx);
-	assert(x > 0);
+	data->no = no;
+	assert((data->no & UMAP_IDX_MASK) == idx);
 
 	data->ptr = ptr;
 	return data->no;
@@ -70,14 +99,22 @@ count_again:;
 
 DLL_LOCAL void umap_del(struct umap_root *root, ulong no)
 {
-	struct umap_meta *meta = &root->meta[no % root->map_sz];
-	struct umap_data *data = &root->data[meta->idx];
+	ulong idx = no & UMAP_IDX_MASK;
+	if (idx >= root->high) {
+		return;
+	}
+	ulong off;
+	int seg = umap_idx_to_seg(root, idx, &off);
+	struct umap_data *data = &root->data[seg][off];
 	if (data->no != no) {
 		// not registered
 		return;
 	}
 	data->no = 0;
 	data->ptr = NULL;
+
+	/* Next number given from this slot will be different. */
+	struct umap_meta *meta = &root->meta[seg][off];
+	meta->gen++;
 	queue_put(&meta->in_queue, &root->free_items);
 }
-
@@ -7,6 +7,17 @@
 
 typedef unsigned long ulong;
 
+/*
+ * Numbers are built from a slot index (low bits) and a per-slot
+ * generation (high bits), so a number stays valid while the table
+ * grows. Slots live in segments: segment 0 has 2^seg0_bits slots, every
+ * next one is as big as all the previous together. Segments are never
+ * moved or freed before umap_free().
+ */
+#define UMAP_IDX_BITS (32)
+#define UMAP_IDX_MASK ((1UL << UMAP_IDX_BITS) - 1)
+#define UMAP_MAX_SEGMENTS (UMAP_IDX_BITS + 1)
+
 struct umap_data {
 	ulong no;		/* currently allocated number */
 	void *ptr;		/* user pointer */
@@ -14,17 +25,20 @@ struct umap_data {
 
 struct umap_meta {
 	ulong idx;		/* position in table */
+	ulong gen;		/* generation of the next number */
 	struct queue_head in_queue;
 };
 
 struct umap_root {
-	ulong counter;		/* max allocated number+1 */
 	ulong max_counter;
 
 	struct queue_root free_items;
-	size_t map_sz;
-	struct umap_data *data;
-	struct umap_meta *meta;
+	int seg0_bits;
+	int segments;		/* number of allocated segments */
+	ulong map_sz;		/* slots in allocated segments */
+	ulong high;		/* never used slots start here */
+	struct umap_data *data[UMAP_MAX_SEGMENTS];
+	struct umap_meta *meta[UMAP_MAX_SEGMENTS];
 };
 
 
@@ -34,9 +48,29 @@ DLL_LOCAL ulong umap_add(struct umap_root *root, void *ptr);
 DLL_LOCAL void umap_del(struct umap_root *root, ulong no);
 
 
+static inline int umap_idx_to_seg(struct umap_root *root, ulong idx,
+				  ulong *off_ptr)
+{
+	ulong q = idx >> root->seg0_bits;
+	if (likely(q == 0)) {
+		*off_ptr = idx;
+		return 0;
+	}
+	int seg = (sizeof(ulong)*8) - __builtin_clzl(q);
+	*off_ptr = idx - (1UL << (root->seg0_bits + seg - 1));
+	return seg;
+}
+
 static inline void *umap_get(struct umap_root *root, ulong no)
 {
-	struct umap_data *data = &root->data[no % root->map_sz];
+	ulong idx = no & UMAP_IDX_MASK;
+	if (unlikely(idx >= root->high)) {
+		// never allocated
+		return NULL;
+	}
+	ulong off;
+	int seg = umap_idx_to_seg(root, idx, &off);
+	struct umap_data *data = &root->data[seg][off];
 	_prefetch(data->ptr);
 	if (unlikely(data->no != no)) {
 		// not registered
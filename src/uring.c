@@ -0,0 +1,125 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "msock_internal.h"
+#include "uring.h"
+
+
+DLL_LOCAL int uring_init(struct uring *ring, unsigned entries)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	memset(ring, 0, sizeof(struct uring));
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd == -1) {
+		return -1;
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_EXT_ARG)) {
+		close(ring->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+	ring->features = p.features;
+
+	size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->ring_sz = max(sq_sz, cq_sz);
+	ring->ring_ptr = mmap(NULL, ring->ring_sz, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, ring->fd,
+			      IORING_OFF_SQ_RING);
+	if (ring->ring_ptr == MAP_FAILED) {
+		close(ring->fd);
+		return -1;
+	}
+	ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		munmap(ring->ring_ptr, ring->ring_sz);
+		close(ring->fd);
+		return -1;
+	}
+
+	char *ptr = ring->ring_ptr;
+	ring->sq_head = (unsigned*)(ptr + p.sq_off.head);
+	ring->sq_tail = (unsigned*)(ptr + p.sq_off.tail);
+	ring->sq_mask = (unsigned*)(ptr + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)(ptr + p.sq_off.array);
+	ring->sq_entries = p.sq_entries;
+
+	ring->cq_head = (unsigned*)(ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned*)(ptr + p.cq_off.tail);
+	ring->cq_mask = (unsigned*)(ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(ptr + p.cq_off.cqes);
+	return 0;
+}
+
+DLL_LOCAL void uring_free(struct uring *ring)
+{
+	munmap(ring->sqes, ring->sqes_sz);
+	munmap(ring->ring_ptr, ring->ring_sz);
+	close(ring->fd);
+}
+
+DLL_LOCAL struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	if (unlikely(ring->to_submit == ring->sq_entries)) {
+		/* Full - push to the kernel what we have. */
+		if (uring_submit_and_wait(ring, 0, 0) == -1) {
+			pfatal("io_uring_enter()");
+		}
+	}
+	unsigned tail = *ring->sq_tail + ring->to_submit;
+	unsigned idx = tail & *ring->sq_mask;
+	ring->sq_array[idx] = idx;
+	ring->to_submit++;
+
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+DLL_LOCAL int uring_submit_and_wait(struct uring *ring, unsigned wait_nr,
+				    long timeout_msecs)
+{
+	unsigned to_submit = ring->to_submit;
+	if (to_submit) {
+		__atomic_store_n(ring->sq_tail, *ring->sq_tail + to_submit,
+				 __ATOMIC_RELEASE);
+		ring->to_submit = 0;
+	}
+
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	unsigned flags = 0;
+	if (wait_nr) {
+		flags |= IORING_ENTER_GETEVENTS;
+		if (timeout_msecs >= 0) {
+			ts.tv_sec = timeout_msecs / 1000;
+			ts.tv_nsec = (timeout_msecs % 1000) * 1000000;
+			arg.ts = (unsigned long)&ts;
+		}
+	}
+	flags |= IORING_ENTER_EXT_ARG;
+
+	while (1) {
+		int r = syscall(__NR_io_uring_enter, ring->fd, to_submit,
+				wait_nr, flags, &arg, sizeof(arg));
+		if (r >= 0) {
+			return r;
+		}
+		if (errno == ETIME) {
+			return 0;
+		}
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+}
@@ -0,0 +1,55 @@
+#ifndef _URING_H
+#define _URING_H
+/*
+ * Minimal io_uring wrapper, straight on top of the syscalls.
+ * Not thread safe - one ring per engine.
+ */
+
+#include <linux/io_uring.h>
+
+struct uring {
+	int fd;
+	unsigned features;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned sq_entries;
+	unsigned to_submit;
+	struct io_uring_sqe *sqes;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *ring_ptr;
+	size_t ring_sz;
+	size_t sqes_sz;
+};
+
+/* Returns -1 and sets errno on failure. */
+DLL_LOCAL int uring_init(struct uring *ring, unsigned entries);
+DLL_LOCAL void uring_free(struct uring *ring);
+DLL_LOCAL struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+/* Submits queued sqes and waits for 'wait_nr' completions, at most
+ * 'timeout_msecs' (-1 means forever). Returns -1 and sets errno. */
+DLL_LOCAL int uring_submit_and_wait(struct uring *ring, unsigned wait_nr,
+				    long timeout_msecs);
+
+static inline struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+	unsigned head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+static inline void uring_cqe_seen(struct uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif // _URING_H